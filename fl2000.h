@@ -7,10 +7,14 @@
 #ifndef __FL2000_DRM_H__
 #define __FL2000_DRM_H__
 
+#include <linux/hrtimer.h>
 #include <linux/i2c.h>
 #include <linux/regmap.h>
+#include <linux/shrinker.h>
 #include <linux/types.h>
 #include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/xarray.h>
 
 #include <drm/drm_modes.h>
 #include <drm/drm_simple_kms_helper.h>
@@ -96,6 +100,292 @@ struct fl2000_timings {
 	u32 vstart;
 };
 
+/* Interrupt events accounting */
+struct fl2000_intr_stats {
+	u64 interrupts;
+	u64 sink_events;
+	u64 lbuf_overflow;
+	u64 lbuf_underflow;
+	u64 lbuf_halt;
+	u64 vga_error;
+	u64 td_drop;
+};
+
+/* Line buffer watermarks tuning */
+struct fl2000_lbuf {
+	struct mutex lock;
+	struct work_struct work;
+	unsigned long events;
+	u32 line_len;
+	u32 lo_mark;
+	u32 hi_mark;
+	u32 assert_rdy;
+	unsigned int lo_extra;
+	unsigned int hi_less;
+	unsigned long last_event;
+	unsigned long last_adjust;
+	u64 adjustments;
+
+	/* Output depth fallback on sustained underflow */
+	struct delayed_work restore_work;
+	u32 hactive;
+	u32 mode_bytes_pix;
+	unsigned int saturated;
+	u64 depth_drops;
+	u64 depth_restores;
+
+	/* Halt recovery */
+	struct work_struct recover_work;
+	ktime_t recover_start;
+	u64 recoveries;
+	u64 recover_failures;
+	s64 recover_last_us;
+	s64 recover_max_us;
+	s64 recover_total_us;
+};
+
+/* Stream pipeline error counters */
+struct fl2000_stream_errors {
+	u64 urb_errors;
+	u64 submit_errors;
+	u64 stalls;
+	u64 halts_cleared;
+	u64 restarts;
+	u64 backoffs;
+};
+
+/* Log2 histogram of durations: bucket N counts durations below 2^N us, last one the rest */
+#define FL2000_HIST_BUCKETS 16
+
+struct fl2000_hist {
+	u64 buckets[FL2000_HIST_BUCKETS];
+	u64 count;
+	u64 sum_us;
+	u64 max_us;
+};
+
+/* Stream pipeline counters */
+struct fl2000_stream_stats {
+	u64 committed;
+	u64 converted;
+	u64 dropped;
+	u64 retransmitted;
+	u64 bytes;
+	u64 run_bytes;
+	struct fl2000_hist convert;
+	struct fl2000_hist latency;
+};
+
+/* Intervals between stream URB completions */
+struct fl2000_stream_jitter {
+	ktime_t last;
+	u64 intervals;
+	s64 last_us;
+	s64 min_us;
+	s64 max_us;
+	u64 sum_us;
+	u64 sum_dev_us;
+};
+
+/* Bulk stream transport, throughput is accounted per altsetting */
+#define FL2000_BULK_ALTS_MAX 8
+
+struct fl2000_bulk_stats {
+	u64 bytes;
+	s64 us;
+};
+
+struct fl2000_bulk {
+	u8 altsetting;
+	unsigned int burst;
+	unsigned int pipe;
+	u64 bytes;
+	struct fl2000_bulk_stats stats[FL2000_BULK_ALTS_MAX];
+};
+
+/* Stream transport */
+enum fl2000_transport {
+	FL2000_TRANSPORT_BULK = 0,
+	FL2000_TRANSPORT_ISOC,
+};
+
+/* Isochronous URB pool: number of URBs and packets per URB */
+#define FL2000_ISOC_URBS 8
+#define FL2000_ISOC_PACKETS 32
+
+struct fl2000_isoc_urb {
+	struct fl2000 *fl2000_dev;
+	struct urb *urb;
+	unsigned int index;
+	bool frame_end;
+	u64 seq;
+};
+
+/* Isochronous stream transport */
+struct fl2000_isoc {
+	u8 altsetting;
+	unsigned int pipe;
+	unsigned int interval;
+	unsigned int packet_size;
+	size_t buf_size;
+	u64 bandwidth;
+	struct fl2000_isoc_urb urbs[FL2000_ISOC_URBS];
+	unsigned long idle;
+
+	/* Frame being transmitted */
+	struct fl2000_stream_buf *sb;
+	size_t offset;
+
+	u64 packet_errors;
+};
+
+/* Triple buffering:
+ *  - one buffer for HDMI rendering
+ *  - one buffer for USB transmission
+ *  - one buffer for DRM/KMS data copy
+ */
+#define FL2000_SB_MIN 3
+#define FL2000_SB_NUM (FL2000_SB_MIN + 1)
+
+/* Number of stream buffers submitted to USB at once. Deeper queue would only resubmit buffers that
+ * are already in flight
+ */
+#define FL2000_QUEUE_DEPTH_MIN 2
+#define FL2000_QUEUE_DEPTH_MAX FL2000_SB_NUM
+
+/* Probe timing, relative to probe start */
+struct fl2000_probe_times {
+	ktime_t start;
+	s64 probe_us;
+	s64 ready_us;
+};
+
+struct fl2000_bw_group;
+struct fl2000_clone_group;
+struct fl2000_tile_group;
+struct fl2000_stream_buf;
+
+/* Place of the device in a tiled group, zero id means no group */
+struct fl2000_tile_cfg {
+	u32 id;
+	u32 cols;
+	u32 rows;
+	u32 col;
+	u32 row;
+	u32 width;
+	u32 height;
+};
+
+struct fl2000_tile {
+	struct fl2000_tile_cfg cfg;
+	struct fl2000_tile_group *group;
+	struct list_head node;
+	struct delayed_work flush_work;
+	u64 flips;
+};
+
+/* Timer driven vblank, kept in step with hardware frame counter */
+struct fl2000_vblank {
+	struct hrtimer timer;
+	spinlock_t lock;
+	bool enabled;
+	ktime_t nominal;
+	ktime_t period;
+	ktime_t stamp;
+	u64 frames;
+	s64 slew_ns;
+	struct delayed_work resync_work;
+
+	/* Frame counter reference */
+	bool hw_valid;
+	u16 hw_cnt;
+	ktime_t hw_stamp;
+	u64 hw_ref;
+	u64 hw_frames;
+	u64 hw_bogus;
+	u64 resyncs;
+	s64 offset;
+};
+
+/* Pixel clock drift against host clock, measured with frame counter */
+struct fl2000_drift {
+	u64 total_ns;
+	u64 total_frames;
+	s64 ppb;
+	s64 ppb_min;
+	s64 ppb_max;
+	u64 samples;
+	u32 biac_status;
+};
+
+/* CRC of distinct stream buffers that can be in flight at once, the re-encoded one included */
+#define FL2000_CRC_SLOTS (FL2000_SB_NUM + 1)
+
+struct fl2000_crc_slot {
+	bool valid;
+	u64 seq;
+	size_t size;
+	u32 value;
+};
+
+/* CRC of submitted stream buffers, reported once buffer transfer completes */
+struct fl2000_crc {
+	spinlock_t lock;
+	bool enabled;
+	struct fl2000_crc_slot slots[FL2000_CRC_SLOTS];
+	unsigned int next;
+	bool pending;
+	u64 pending_frame;
+	u32 pending_value;
+	u64 frame;
+};
+
+/* Line buffer watermarks kept for history */
+#define FL2000_TELEMETRY_HISTORY 32
+
+/* Sampled hardware counters */
+struct fl2000_telemetry {
+	struct delayed_work work;
+	spinlock_t lock;
+	u32 pll_clock;
+	bool valid;
+	u32 pxclk_cnt;
+	ktime_t stamp;
+	u64 total_clocks;
+	u64 total_ns;
+	u64 pixclock;
+	u32 aclk_count;
+	bool aclk_hit;
+	u32 accumulate;
+	u32 accumulate_max;
+	u32 watermark;
+	u32 watermark_min;
+	u64 samples;
+	u64 skipped;
+	u64 near_underflow;
+	u16 history[FL2000_TELEMETRY_HISTORY];
+	unsigned int head;
+};
+
+/* Stream buffer lists, for tracing */
+enum fl2000_sb_state {
+	FL2000_SB_RENDER,
+	FL2000_SB_PENDING,
+	FL2000_SB_TRANSMIT,
+	FL2000_SB_WAIT,
+};
+
+/* Just-in-time frame submission */
+struct fl2000_pacing {
+	struct hrtimer timer;
+	spinlock_t lock;
+	ktime_t expected_end;
+	s64 lead_ns;
+	u64 holds;
+	u64 starved;
+	u64 skipped;
+};
+
 struct fl2000_pll {
 	u32 prescaler;
 	u32 multiplier;
@@ -104,6 +394,11 @@ struct fl2000_pll {
 	u32 min_ppm_err;
 };
 
+/* DRM file usage reported in fdinfo */
+struct fl2000_file {
+	u64 convert_ns;
+};
+
 /* Devices that are independent of interfaces, created for the lifetime of USB device instance */
 struct fl2000 {
 	/* USB device properties */
@@ -119,22 +414,81 @@ struct fl2000 {
 	struct drm_device drm;
 	struct drm_simple_display_pipe pipe;
 	struct drm_connector connector;
+	struct drm_crtc_funcs crtc_funcs;
+	struct fl2000_vblank vblank;
+	struct fl2000_drift drift;
+	struct fl2000_crc crc;
+	struct work_struct init_work;
+	struct fl2000_probe_times probe_times;
+
+	/* Per client accounting */
+	struct xarray fb_owners;
+	struct fl2000_file *stream_owner;
+
+	/* USB bandwidth budget */
+	struct fl2000_bw_group *bw_group;
+	u64 bw_allocated;
+	u64 link_bw;
+
+	/* Clone group membership */
+	struct fl2000_clone_group *clone_group;
+	struct list_head clone_node;
+
+	/* Tiled group membership */
+	struct fl2000_tile tile;
 
 	/* Framebuffer streaming */
 	struct list_head render_list;
 	struct list_head transmit_list;
 	struct list_head wait_list;
+	struct list_head pending_list;
 	spinlock_t list_lock;
 
 	size_t buf_size;
 	int bytes_pix;
+	u64 frame_seq;
+	u64 shown_seq;
+	u32 width;
+	u32 height;
+	u32 pixclock;
+
+	/* Buffers retained while stream is disabled */
+	unsigned long idle_pages;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct shrinker *shrinker;
+#else
+	struct shrinker shrinker;
+#endif
 
 	struct work_struct stream_work;
-	struct workqueue_struct *stream_work_queue;
-	struct completion stream_complete;
+	atomic_t stream_credits;
+	unsigned int queue_depth;
+	atomic_t depth_debt;
+	struct mutex stream_lock;
+	unsigned int paused;
+	bool active;
 	bool enabled;
 
+	struct fl2000_lbuf lbuf;
+	struct fl2000_telemetry telemetry;
+
+	enum fl2000_transport transport;
+	struct fl2000_bulk bulk;
+	struct fl2000_isoc isoc;
+	ktime_t stream_start;
+
 	struct usb_anchor anchor;
+	atomic_t urbs_in_flight;
+	unsigned long last_completion;
+	unsigned long stream_flags;
+	struct work_struct restart_work;
+	struct delayed_work watchdog;
+	struct delayed_work retry_work;
+	unsigned int error_streak;
+	struct fl2000_stream_errors stream_errors;
+	struct fl2000_stream_stats stream_stats;
+	struct fl2000_stream_jitter stream_jitter;
+	struct fl2000_pacing pacing;
 
 	int print_complete;
 	
@@ -143,10 +497,18 @@ struct fl2000 {
 	struct urb *intr_urb;
 	u8 *intr_buf;
 	dma_addr_t transfer_dma;
+	struct urb *status_urb;
+	struct usb_ctrlrequest *status_req;
+	u32 *status_buf;
 	struct work_struct intr_work;
-	struct workqueue_struct *intr_work_queue;
+	struct fl2000_intr_stats intr_stats;
+	spinlock_t intr_lock;
 };
 
+/* Module-wide workqueues shared by all devices */
+extern struct workqueue_struct *fl2000_stream_wq;
+extern struct workqueue_struct *fl2000_event_wq;
+
 /* Timeout in us for I2C read/write operations */
 #define I2C_RDWR_INTERVAL (200)
 #define I2C_RDWR_TIMEOUT (256 * 1000)
@@ -156,17 +518,136 @@ int fl2000_stream_create(struct fl2000 *fl2000_dev);
 void fl2000_stream_release(struct fl2000 *fl2000_dev);
 
 /* Streaming interface */
-int fl2000_stream_mode_set(struct fl2000 *fl2000_dev, int pixels,
+int fl2000_stream_mode_set(struct fl2000 *fl2000_dev, u32 width, u32 height,
 			   u32 bytes_pix);
+int fl2000_stream_set_format(struct fl2000 *fl2000_dev, u32 bytes_pix);
 void fl2000_stream_compress(struct fl2000 *fl2000_dev, void *src,
 			    unsigned int height, unsigned int width,
-			    unsigned int pitch);
+			    unsigned int pitch, u64 seq);
 int fl2000_stream_enable(struct fl2000 *fl2000_dev);
 void fl2000_stream_disable(struct fl2000 *fl2000_dev);
+void fl2000_stream_pause(struct fl2000 *fl2000_dev);
+void fl2000_stream_resume(struct fl2000 *fl2000_dev);
+unsigned int fl2000_stream_set_depth(struct fl2000 *fl2000_dev,
+				     unsigned int depth);
+struct fl2000_stream_buf *fl2000_stream_clone_buf(struct fl2000 *fl2000_dev);
+int fl2000_stream_set_transport(struct fl2000 *fl2000_dev,
+				enum fl2000_transport transport);
+bool fl2000_stream_tile_pending(struct fl2000 *fl2000_dev);
+bool fl2000_stream_tile_flip(struct fl2000 *fl2000_dev);
+unsigned long fl2000_stream_pages(struct fl2000 *fl2000_dev);
+
+/* Just-in-time frame submission */
+void fl2000_pacing_init(struct fl2000 *fl2000_dev);
+void fl2000_pacing_start(struct fl2000 *fl2000_dev);
+void fl2000_pacing_stop(struct fl2000 *fl2000_dev);
+bool fl2000_pacing_active(struct fl2000 *fl2000_dev);
+bool fl2000_pacing_hold(struct fl2000 *fl2000_dev);
+void fl2000_pacing_submitted(struct fl2000 *fl2000_dev);
+void fl2000_pacing_completed(struct fl2000 *fl2000_dev);
+void fl2000_pacing_underflow(struct fl2000 *fl2000_dev);
+
+/* Isochronous transport */
+int fl2000_isoc_setup(struct fl2000 *fl2000_dev);
+void fl2000_isoc_release(struct fl2000 *fl2000_dev);
+int fl2000_isoc_submit(struct fl2000 *fl2000_dev, struct fl2000_isoc_urb *iurb,
+		       const void *data, size_t len, bool frame_end,
+		       usb_complete_t complete);
+
+/* Clone groups */
+int fl2000_clone_join(struct fl2000 *fl2000_dev, u32 id);
+void fl2000_clone_release(struct fl2000 *fl2000_dev);
+u32 fl2000_clone_id(struct fl2000 *fl2000_dev);
+bool fl2000_clone_follower(struct fl2000 *fl2000_dev);
+struct fl2000_stream_buf *fl2000_clone_get_buf(struct fl2000 *fl2000_dev);
+
+/* USB bandwidth budget */
+int fl2000_bw_init(struct fl2000 *fl2000_dev);
+void fl2000_bw_release(struct fl2000 *fl2000_dev);
+u32 fl2000_bw_bytes_pix(struct fl2000 *fl2000_dev, u32 pixclock, bool shared);
+int fl2000_bw_reserve(struct fl2000 *fl2000_dev, u64 bw);
+u64 fl2000_bw_budget(struct fl2000 *fl2000_dev);
+void fl2000_calibrate(struct fl2000 *fl2000_dev);
+
+/* Tiled groups */
+void fl2000_tile_init(struct fl2000 *fl2000_dev);
+void fl2000_tile_release(struct fl2000 *fl2000_dev);
+int fl2000_tile_set(struct fl2000 *fl2000_dev,
+		    const struct fl2000_tile_cfg *cfg);
+void fl2000_tile_get(struct fl2000 *fl2000_dev, struct fl2000_tile_cfg *cfg);
+void fl2000_tile_commit(struct fl2000 *fl2000_dev);
+
+/* Line buffer watermarks tuning */
+void fl2000_lbuf_init(struct fl2000 *fl2000_dev);
+void fl2000_lbuf_release(struct fl2000 *fl2000_dev);
+void fl2000_lbuf_mode_set(struct fl2000 *fl2000_dev, u32 hactive,
+			  u32 bytes_pix);
+void fl2000_lbuf_event(struct fl2000 *fl2000_dev, bool underflow,
+		       bool overflow);
+bool fl2000_lbuf_settled(struct fl2000 *fl2000_dev);
+void fl2000_lbuf_restore(struct fl2000 *fl2000_dev);
+void fl2000_lbuf_halt(struct fl2000 *fl2000_dev);
 
 /* Interrupt polling task */
 int fl2000_intr_create(struct fl2000 *fl2000_dev);
 void fl2000_intr_release(struct fl2000 *fl2000_dev);
+void fl2000_intr_stop(struct fl2000 *fl2000_dev);
+int fl2000_intr_start(struct fl2000 *fl2000_dev);
+int fl2000_intr_poll(struct fl2000 *fl2000_dev);
+
+/* Timer driven vblank */
+void fl2000_vblank_init(struct fl2000 *fl2000_dev);
+void fl2000_vblank_release(struct fl2000 *fl2000_dev);
+void fl2000_vblank_mode_set(struct fl2000 *fl2000_dev,
+			    const struct drm_display_mode *mode, u32 pixclock);
+void fl2000_vblank_sample(struct fl2000 *fl2000_dev, u16 frame_cnt);
+int fl2000_vblank_enable(struct drm_simple_display_pipe *pipe);
+void fl2000_vblank_disable(struct drm_simple_display_pipe *pipe);
+
+/* Clock drift compensation */
+ktime_t fl2000_drift_update(struct fl2000 *fl2000_dev, ktime_t elapsed,
+			    u32 frames, ktime_t nominal);
+void fl2000_drift_reset(struct fl2000 *fl2000_dev);
+void fl2000_drift_poll(struct fl2000 *fl2000_dev);
+
+/* Output CRC capture */
+void fl2000_crc_init(struct fl2000 *fl2000_dev);
+void fl2000_crc_frame(struct fl2000 *fl2000_dev, const void *data, size_t size,
+		      u64 seq);
+void fl2000_crc_shown(struct fl2000 *fl2000_dev, u64 seq);
+
+/* Hardware counters sampling */
+void fl2000_telemetry_init(struct fl2000 *fl2000_dev);
+void fl2000_telemetry_mode_set(struct fl2000 *fl2000_dev, u32 pll_clock);
+void fl2000_telemetry_start(struct fl2000 *fl2000_dev);
+void fl2000_telemetry_stop(struct fl2000 *fl2000_dev);
+
+/* DRM fdinfo usage */
+struct drm_printer;
+void fl2000_fdinfo_init(struct fl2000 *fl2000_dev);
+void fl2000_fdinfo_release(struct fl2000 *fl2000_dev);
+int fl2000_fdinfo_open(struct drm_device *drm, struct drm_file *file);
+void fl2000_fdinfo_postclose(struct drm_device *drm, struct drm_file *file);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+struct drm_framebuffer *
+fl2000_fdinfo_fb_create(struct drm_device *drm, struct drm_file *file,
+			const struct drm_format_info *info,
+			const struct drm_mode_fb_cmd2 *mode_cmd);
+#else
+struct drm_framebuffer *
+fl2000_fdinfo_fb_create(struct drm_device *drm, struct drm_file *file,
+			const struct drm_mode_fb_cmd2 *mode_cmd);
+#endif
+void fl2000_fdinfo_account(struct fl2000 *fl2000_dev,
+			   struct drm_framebuffer *fb, u64 ns);
+void fl2000_fdinfo_show(struct drm_printer *p, struct drm_file *file);
+
+/* Debug file system entries */
+void fl2000_debugfs_init(struct fl2000 *fl2000_dev);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+struct drm_minor;
+void fl2000_debugfs_minor_init(struct drm_minor *minor);
+#endif
 
 /* I2C adapter interface creation */
 struct i2c_adapter *fl2000_i2c_init(struct usb_device *usb_dev);
@@ -179,21 +660,32 @@ int fl2000_i2c_write_dword(struct usb_device *usb_dev, u16 addr, u8 offset,
 
 /* Connector functions */
 int fl2000_connector_init(struct fl2000 *fl2000_dev);
+void fl2000_connector_update_tile(struct fl2000 *fl2000_dev);
 
 /* Register map creation */
 struct regmap *fl2000_regmap_init(struct usb_device *usb_dev);
 
 /* Registers interface */
 int fl2000_reset(struct usb_device *usb_dev);
+int fl2000_lbuf_reset(struct usb_device *usb_dev);
+int fl2000_restore(struct usb_device *usb_dev);
 int fl2000_usb_magic(struct usb_device *usb_dev);
 int fl2000_afe_magic(struct usb_device *usb_dev);
 int fl2000_set_transfers(struct usb_device *usb_dev);
 int fl2000_set_pixfmt(struct usb_device *usb_dev, u32 bytes_pix);
+int fl2000_set_isoc(struct usb_device *usb_dev, bool enable);
+int fl2000_set_watermarks(struct usb_device *usb_dev, u32 lo_mark, u32 hi_mark,
+			  u32 assert_rdy);
 int fl2000_set_timings(struct usb_device *usb_dev,
 		       struct fl2000_timings *timings);
 int fl2000_set_pll(struct usb_device *usb_dev, struct fl2000_pll *pll);
 int fl2000_enable_interrupts(struct usb_device *usb_dev);
-int fl2000_check_interrupt(struct usb_device *usb_dev);
+u32 fl2000_status_ack_mask(union fl2000_vga_status_reg status);
+int fl2000_check_interrupt(struct usb_device *usb_dev,
+			   union fl2000_vga_status_reg *status);
+void fl2000_fill_reg_urb(struct usb_device *usb_dev, struct urb *urb,
+			 struct usb_ctrlrequest *req, u32 *data, bool read,
+			 u32 reg, usb_complete_t complete, void *context);
 int fl2000_i2c_dword(struct usb_device *usb_dev, bool read, u16 addr, u8 offset,
 		     u32 *data);
 
@@ -201,5 +693,6 @@ int fl2000_i2c_dword(struct usb_device *usb_dev, bool read, u16 addr, u8 offset,
 extern const struct drm_driver fl2000_drm_driver;
 int fl2000_drm_init(struct fl2000 *fl2000_dev);
 void fl2000_drm_release(struct fl2000 *fl2000_dev);
+int fl2000_output_restore(struct fl2000 *fl2000_dev);
 
 #endif /* __FL2000_DRM_H__ */
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * USB bandwidth budget shared by devices behind the same root port. All such devices stream
+ * through one upstream link, so the sum of their streams shall fit into that link. Atomic check
+ * picks output depth that fits into what is left by other devices and rejects modes that do not
+ * fit at all. Depth is carried in CRTC state, bandwidth is reserved only when that state is
+ * committed and released on disable
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+#include "fl2000.h"
+
+/* Nominal bulk bandwidth is the full signaling rate, real one can be measured with calibration */
+#define FL2000_BULK_BW_PERCENT 100
+
+#define FL2000_BULK_BW_HIGH_SPEED                                              \
+	(480000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
+#define FL2000_BULK_BW_SUPER_SPEED                                             \
+	(5000000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
+#define FL2000_BULK_BW_SUPER_SPEED_PLUS                                        \
+	(10000000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
+
+/* Maximum bytes per pixel supported by HW */
+#define FL2000_BYTES_PIX_MAX 3
+
+/* Devices sharing one upstream link */
+struct fl2000_bw_group {
+	struct list_head list;
+	struct usb_bus *bus;
+	int portnum;
+	u64 capacity;
+	u64 allocated;
+	unsigned int members;
+};
+
+static LIST_HEAD(fl2000_bw_groups);
+static DEFINE_MUTEX(fl2000_bw_lock);
+
+/* Bulk bandwidth of the link, bytes per second */
+static u64 fl2000_bw_link(enum usb_device_speed speed)
+{
+	switch (speed) {
+	case USB_SPEED_HIGH:
+		return FL2000_BULK_BW_HIGH_SPEED;
+	case USB_SPEED_SUPER:
+		return FL2000_BULK_BW_SUPER_SPEED;
+	case USB_SPEED_SUPER_PLUS:
+		return FL2000_BULK_BW_SUPER_SPEED_PLUS;
+	default:
+		return 0;
+	}
+}
+
+/* Bandwidth available to the device: reserved periodic bandwidth for isochronous transfers,
+ * measured or nominal one for bulk transfers
+ */
+static u64 fl2000_bw_dev_link(struct fl2000 *fl2000_dev)
+{
+	u64 link_bw = READ_ONCE(fl2000_dev->link_bw);
+	u64 nominal = fl2000_bw_link(fl2000_dev->usb_dev->speed);
+
+	if (fl2000_dev->transport == FL2000_TRANSPORT_ISOC)
+		return fl2000_dev->isoc.bandwidth;
+
+	return link_bw ? min(link_bw, nominal) : nominal;
+}
+
+/* Device attached directly to the root hub, i.e. the device itself or its topmost hub */
+static struct usb_device *fl2000_bw_root(struct usb_device *usb_dev)
+{
+	while (usb_dev->parent && usb_dev->parent->parent)
+		usb_dev = usb_dev->parent;
+
+	return usb_dev;
+}
+
+/* Shall be called with bandwidth lock held */
+static void fl2000_bw_set(struct fl2000 *fl2000_dev, u64 bw)
+{
+	struct fl2000_bw_group *group = fl2000_dev->bw_group;
+
+	if (group)
+		group->allocated = group->allocated -
+				   fl2000_dev->bw_allocated + bw;
+	fl2000_dev->bw_allocated = bw;
+}
+
+/* Shall be called with bandwidth lock held */
+static u64 fl2000_bw_available(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_bw_group *group = fl2000_dev->bw_group;
+	u64 link = fl2000_bw_dev_link(fl2000_dev);
+	u64 available;
+
+	if (!group)
+		return link;
+
+	/* Bandwidth already reserved by this device is available for it */
+	available = group->capacity - group->allocated + fl2000_dev->bw_allocated;
+
+	return min(link, available);
+}
+
+/* Bandwidth the device can use now, bytes per second */
+u64 fl2000_bw_budget(struct fl2000 *fl2000_dev)
+{
+	u64 available;
+
+	mutex_lock(&fl2000_bw_lock);
+	available = fl2000_bw_available(fl2000_dev);
+	mutex_unlock(&fl2000_bw_lock);
+
+	return available;
+}
+
+/**
+ * fl2000_bw_bytes_pix() - get bytes per pixel that fit into the bandwidth budget
+ * @fl2000_dev:	FL2000 device
+ * @pixclock:	pixel clock, Hz
+ * @shared:	account bandwidth reserved by other devices on the same link
+ *
+ * Return: Maximum number of bytes per pixel, 0 if mode cannot be streamed
+ */
+u32 fl2000_bw_bytes_pix(struct fl2000 *fl2000_dev, u32 pixclock, bool shared)
+{
+	u64 available;
+
+	if (!pixclock)
+		return 0;
+
+	if (shared)
+		available = fl2000_bw_budget(fl2000_dev);
+	else
+		available = fl2000_bw_dev_link(fl2000_dev);
+
+	return min_t(u64, div_u64(available, pixclock), FL2000_BYTES_PIX_MAX);
+}
+
+/**
+ * fl2000_bw_reserve() - reserve bandwidth of the stream
+ * @fl2000_dev:	FL2000 device
+ * @bw:		stream bandwidth, bytes per second. Zero releases reservation
+ *
+ * Previous reservation of the device is replaced
+ *
+ * Return: Operation result, -ENOSPC if stream does not fit into the budget
+ */
+int fl2000_bw_reserve(struct fl2000 *fl2000_dev, u64 bw)
+{
+	int ret = 0;
+
+	mutex_lock(&fl2000_bw_lock);
+
+	if (bw > fl2000_bw_available(fl2000_dev)) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	fl2000_bw_set(fl2000_dev, bw);
+
+unlock:
+	mutex_unlock(&fl2000_bw_lock);
+
+	return ret;
+}
+
+/* Shall be called before device can stream */
+int fl2000_bw_init(struct fl2000 *fl2000_dev)
+{
+	struct usb_device *root = fl2000_bw_root(fl2000_dev->usb_dev);
+	struct fl2000_bw_group *group;
+	int ret = 0;
+
+	mutex_lock(&fl2000_bw_lock);
+
+	/* USB 2 and USB 3 root hubs number their ports independently and have separate links */
+	list_for_each_entry (group, &fl2000_bw_groups, list) {
+		if (group->bus == root->bus &&
+		    group->portnum == root->portnum)
+			goto join;
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	group->bus = root->bus;
+	group->portnum = root->portnum;
+	group->capacity = fl2000_bw_link(root->speed);
+	list_add_tail(&group->list, &fl2000_bw_groups);
+
+join:
+	group->members++;
+	fl2000_dev->bw_group = group;
+	fl2000_dev->bw_allocated = 0;
+
+	dev_dbg(&fl2000_dev->usb_dev->dev,
+		"Bandwidth group %d-%d, %u device(s), %llu B/s",
+		group->bus->busnum, group->portnum, group->members,
+		group->capacity);
+
+unlock:
+	mutex_unlock(&fl2000_bw_lock);
+
+	return ret;
+}
+
+void fl2000_bw_release(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_bw_group *group = fl2000_dev->bw_group;
+
+	if (!group)
+		return;
+
+	mutex_lock(&fl2000_bw_lock);
+
+	group->allocated -= fl2000_dev->bw_allocated;
+	fl2000_dev->bw_allocated = 0;
+	fl2000_dev->bw_group = NULL;
+
+	if (!--group->members) {
+		list_del(&group->list);
+		kfree(group);
+	}
+
+	mutex_unlock(&fl2000_bw_lock);
+}
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Link throughput calibration. Nominal USB signaling rate is never reached by bulk transfers on
+ * real host controllers and hubs, so optionally a timed burst of black data is streamed to the
+ * device and effective throughput is measured. Measured figure limits bytes per pixel selection
+ * and mode validation instead of the nominal one.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/atomic.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+
+#include "fl2000.h"
+
+static bool calibrate;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "Measure link throughput on probe (default: false)");
+
+/* Burst duration, ms */
+#define FL2000_CALIB_MS 250
+
+/* URBs kept in flight and size of each of them */
+#define FL2000_CALIB_URBS 4
+#define FL2000_CALIB_URB_SIZE (256 * 1024)
+
+/* Results below that are not a measurement of the link, but of the device not accepting data */
+#define FL2000_CALIB_BW_MIN (1024 * 1024)
+
+struct fl2000_calib {
+	struct usb_anchor anchor;
+	atomic64_t bytes;
+	ktime_t deadline;
+	ktime_t last;
+	bool stop;
+};
+
+static void fl2000_calib_completion(struct urb *urb)
+{
+	struct fl2000_calib *calib = urb->context;
+	ktime_t now = ktime_get();
+
+	if (urb->status)
+		return;
+
+	atomic64_add(urb->actual_length, &calib->bytes);
+	WRITE_ONCE(calib->last, now);
+
+	if (READ_ONCE(calib->stop) || ktime_after(now, calib->deadline))
+		return;
+
+	usb_anchor_urb(urb, &calib->anchor);
+	if (usb_submit_urb(urb, GFP_ATOMIC))
+		usb_unanchor_urb(urb);
+}
+
+/**
+ * fl2000_calibrate() - measure effective bulk throughput of the link
+ * @fl2000_dev:	FL2000 device
+ *
+ * Does nothing unless enabled with module parameter. Shall be called with stream disabled, blocks
+ * for the duration of the burst. Result is stored in the device, zero if measurement failed
+ */
+void fl2000_calibrate(struct fl2000 *fl2000_dev)
+{
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	struct urb *urbs[FL2000_CALIB_URBS] = {};
+	struct fl2000_calib calib;
+	ktime_t start;
+	s64 elapsed_us;
+	u64 bw = 0;
+	void *buf;
+	int i;
+
+	if (!calibrate || fl2000_dev->transport != FL2000_TRANSPORT_BULK)
+		return;
+
+	/* Black frame data, shared by all URBs */
+	buf = kzalloc(FL2000_CALIB_URB_SIZE, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	init_usb_anchor(&calib.anchor);
+	atomic64_set(&calib.bytes, 0);
+	calib.stop = false;
+
+	for (i = 0; i < FL2000_CALIB_URBS; i++) {
+		urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urbs[i])
+			goto free;
+		usb_fill_bulk_urb(urbs[i], usb_dev, fl2000_dev->bulk.pipe, buf,
+				  FL2000_CALIB_URB_SIZE,
+				  fl2000_calib_completion, &calib);
+	}
+
+	start = ktime_get();
+	calib.last = start;
+	calib.deadline = ktime_add_ms(start, FL2000_CALIB_MS);
+
+	for (i = 0; i < FL2000_CALIB_URBS; i++) {
+		usb_anchor_urb(urbs[i], &calib.anchor);
+		if (usb_submit_urb(urbs[i], GFP_KERNEL)) {
+			usb_unanchor_urb(urbs[i]);
+			break;
+		}
+	}
+
+	/* Device that does not accept data does not complete anything */
+	if (!usb_wait_anchor_empty_timeout(&calib.anchor,
+					   FL2000_CALIB_MS * 2)) {
+		WRITE_ONCE(calib.stop, true);
+		usb_kill_anchored_urbs(&calib.anchor);
+	}
+
+	elapsed_us = ktime_us_delta(calib.last, start);
+	if (elapsed_us > 0)
+		bw = div64_u64(atomic64_read(&calib.bytes) * USEC_PER_SEC,
+			       elapsed_us);
+	if (bw < FL2000_CALIB_BW_MIN)
+		bw = 0;
+
+	if (bw)
+		dev_info(&usb_dev->dev, "Measured link throughput %llu B/s", bw);
+	else
+		dev_warn(&usb_dev->dev,
+			 "Link calibration failed, using nominal throughput");
+
+	WRITE_ONCE(fl2000_dev->link_bw, bw);
+
+free:
+	for (i = 0; i < FL2000_CALIB_URBS; i++)
+		usb_free_urb(urbs[i]);
+	kfree(buf);
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Clone groups mirror one picture to several devices. Only the group leader, which is the first
+ * streaming member, converts its framebuffer. Other members with the same mode skip conversion
+ * and stream the frames of the leader: the very same buffer is submitted to every device. Members
+ * with a different mode keep converting their own framebuffers. Isochronous stream keeps its own
+ * buffers in flight for a whole frame and is never fed with buffers of another device, so members
+ * using it neither lead nor follow.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "fl2000.h"
+
+struct fl2000_clone_group {
+	struct list_head list;
+	u32 id;
+	struct list_head members;
+};
+
+static LIST_HEAD(fl2000_clone_groups);
+static DEFINE_SPINLOCK(fl2000_clone_lock);
+
+/* Shall be called with clone lock held */
+static struct fl2000 *fl2000_clone_leader(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_clone_group *group = fl2000_dev->clone_group;
+	struct fl2000 *leader;
+
+	if (!group ||
+	    READ_ONCE(fl2000_dev->transport) == FL2000_TRANSPORT_ISOC)
+		return NULL;
+
+	list_for_each_entry (leader, &group->members, clone_node) {
+		if (!READ_ONCE(leader->enabled) ||
+		    READ_ONCE(leader->transport) == FL2000_TRANSPORT_ISOC)
+			continue;
+
+		/* Leader streams its own frames */
+		if (leader == fl2000_dev)
+			return NULL;
+
+		/* Frames of a different format are of no use */
+		if (READ_ONCE(leader->buf_size) !=
+			    READ_ONCE(fl2000_dev->buf_size) ||
+		    READ_ONCE(leader->bytes_pix) !=
+			    READ_ONCE(fl2000_dev->bytes_pix))
+			return NULL;
+
+		return leader;
+	}
+
+	return NULL;
+}
+
+/**
+ * fl2000_clone_get_buf() - get frame converted by the clone group leader
+ * @fl2000_dev:	FL2000 device
+ *
+ * Return: Referenced stream buffer of the leader, NULL if device shall stream its own frames
+ */
+struct fl2000_stream_buf *fl2000_clone_get_buf(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *sb = NULL;
+	struct fl2000 *leader;
+
+	if (!READ_ONCE(fl2000_dev->clone_group))
+		return NULL;
+
+	spin_lock(&fl2000_clone_lock);
+	leader = fl2000_clone_leader(fl2000_dev);
+	if (leader)
+		sb = fl2000_stream_clone_buf(leader);
+	spin_unlock(&fl2000_clone_lock);
+
+	return sb;
+}
+
+/* Framebuffer of the follower is not streamed, so there is no need to convert it */
+bool fl2000_clone_follower(struct fl2000 *fl2000_dev)
+{
+	bool follower;
+
+	if (!READ_ONCE(fl2000_dev->clone_group))
+		return false;
+
+	spin_lock(&fl2000_clone_lock);
+	follower = !!fl2000_clone_leader(fl2000_dev);
+	spin_unlock(&fl2000_clone_lock);
+
+	return follower;
+}
+
+/* Shall be called with clone lock held */
+static void fl2000_clone_unlink(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_clone_group *group = fl2000_dev->clone_group;
+
+	if (!group)
+		return;
+
+	list_del(&fl2000_dev->clone_node);
+	fl2000_dev->clone_group = NULL;
+
+	if (list_empty(&group->members)) {
+		list_del(&group->list);
+		kfree(group);
+	}
+}
+
+/**
+ * fl2000_clone_join() - move device to a clone group
+ * @fl2000_dev:	FL2000 device
+ * @id:		group identifier, 0 to leave the group
+ *
+ * Return: Operation result
+ */
+int fl2000_clone_join(struct fl2000 *fl2000_dev, u32 id)
+{
+	struct fl2000_clone_group *group, *new_group = NULL;
+
+	if (id) {
+		new_group = kzalloc(sizeof(*new_group), GFP_KERNEL);
+		if (!new_group)
+			return -ENOMEM;
+		new_group->id = id;
+		INIT_LIST_HEAD(&new_group->members);
+	}
+
+	spin_lock(&fl2000_clone_lock);
+
+	fl2000_clone_unlink(fl2000_dev);
+	if (!id)
+		goto unlock;
+
+	list_for_each_entry (group, &fl2000_clone_groups, list) {
+		if (group->id == id)
+			goto join;
+	}
+
+	group = new_group;
+	new_group = NULL;
+	list_add_tail(&group->list, &fl2000_clone_groups);
+
+join:
+	list_add_tail(&fl2000_dev->clone_node, &group->members);
+	fl2000_dev->clone_group = group;
+
+unlock:
+	spin_unlock(&fl2000_clone_lock);
+
+	kfree(new_group);
+
+	return 0;
+}
+
+u32 fl2000_clone_id(struct fl2000 *fl2000_dev)
+{
+	u32 id = 0;
+
+	spin_lock(&fl2000_clone_lock);
+	if (fl2000_dev->clone_group)
+		id = fl2000_dev->clone_group->id;
+	spin_unlock(&fl2000_clone_lock);
+
+	return id;
+}
+
+/* Shall be called before stream is released, so that no member picks buffers of the device */
+void fl2000_clone_release(struct fl2000 *fl2000_dev)
+{
+	spin_lock(&fl2000_clone_lock);
+	fl2000_clone_unlink(fl2000_dev);
+	spin_unlock(&fl2000_clone_lock);
+}
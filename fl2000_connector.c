@@ -35,11 +35,79 @@ static int fl2000_get_modes(struct drm_connector *connector)
 	ret = drm_edid_connector_add_modes(connector);
 	kfree(edid);
 
+	/* EDID update resets tile information */
+	fl2000_connector_update_tile(
+		container_of(connector, struct fl2000, connector));
+
 	//ret = drm_add_modes_noedid(connector, 1920, 1200);
 	//drm_set_preferred_mode(connector, 1024, 768);
 	return ret;
 }
 
+/* Tile group topology identifier, unique among devices of this driver */
+static void fl2000_tile_topology(u32 id, char topology[8])
+{
+	__le32 le_id = cpu_to_le32(id);
+
+	memcpy(topology, "fl2k", 4);
+	memcpy(&topology[4], &le_id, sizeof(le_id));
+}
+
+/**
+ * fl2000_connector_update_tile() - update TILE property from tiled group configuration
+ * @fl2000_dev:	FL2000 device
+ *
+ * Shall be called with mode config mutex held. Tile information from EDID is kept if device is not
+ * in a tiled group
+ */
+void fl2000_connector_update_tile(struct fl2000 *fl2000_dev)
+{
+	struct drm_connector *connector = &fl2000_dev->connector;
+	struct drm_device *drm = connector->dev;
+	struct drm_tile_group *tile_group = connector->tile_group;
+	struct fl2000_tile_cfg cfg;
+	char topology[8];
+	bool ours;
+
+	fl2000_tile_get(fl2000_dev, &cfg);
+
+	ours = tile_group && !memcmp(tile_group->group_data, "fl2k", 4);
+	if (!cfg.id && !ours)
+		return;
+
+	fl2000_tile_topology(cfg.id, topology);
+	if (tile_group && (!cfg.id ||
+			   memcmp(tile_group->group_data, topology, 8))) {
+		drm_mode_put_tile_group(drm, tile_group);
+		connector->tile_group = NULL;
+	}
+
+	connector->has_tile = !!cfg.id;
+	if (cfg.id) {
+		if (!connector->tile_group) {
+			tile_group = drm_mode_get_tile_group(drm, topology);
+			if (!tile_group)
+				tile_group = drm_mode_create_tile_group(drm,
+									topology);
+			if (!tile_group) {
+				connector->has_tile = false;
+				goto set_property;
+			}
+			connector->tile_group = tile_group;
+		}
+		connector->tile_is_single_monitor = false;
+		connector->num_h_tile = cfg.cols;
+		connector->num_v_tile = cfg.rows;
+		connector->tile_h_loc = cfg.col;
+		connector->tile_v_loc = cfg.row;
+		connector->tile_h_size = cfg.width;
+		connector->tile_v_size = cfg.height;
+	}
+
+set_property:
+	drm_connector_set_tile_property(connector);
+}
+
 static enum drm_mode_status
 fl2000_connector_mode_valid(struct drm_connector *connector,
 			    struct drm_display_mode *mode)
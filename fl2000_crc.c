@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * CRC capture of the output. There is no way to read back what the device scans out, so CRC is
+ * computed over stream buffers as they are submitted, i.e. over the exact data sent to the device
+ * in the stream format. Frames submitted again are not recomputed.
+ *
+ * Several frames may be queued ahead, so the entry is reported when transfer of the buffer
+ * completes, for the frame that follows. When more buffers complete within one vblank, the last
+ * one is what gets shown: entry is held back until a completion for a later frame comes.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/crc32.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include <drm/drm_crtc.h>
+#include <drm/drm_debugfs_crc.h>
+#include <drm/drm_vblank.h>
+
+#include "fl2000.h"
+
+static const char *const fl2000_crc_sources[] = { "auto", "stream" };
+
+static bool fl2000_crc_source_valid(const char *source)
+{
+	return !source || !strcmp(source, "none") ||
+	       match_string(fl2000_crc_sources, ARRAY_SIZE(fl2000_crc_sources),
+			    source) >= 0;
+}
+
+static int fl2000_crc_verify_source(struct drm_crtc *crtc, const char *source,
+				    size_t *values_cnt)
+{
+	if (!fl2000_crc_source_valid(source))
+		return -EINVAL;
+
+	*values_cnt = 1;
+
+	return 0;
+}
+
+static const char *const *fl2000_crc_get_sources(struct drm_crtc *crtc,
+						 size_t *count)
+{
+	*count = ARRAY_SIZE(fl2000_crc_sources);
+
+	return fl2000_crc_sources;
+}
+
+static int fl2000_crc_set_source(struct drm_crtc *crtc, const char *source)
+{
+	struct fl2000 *fl2000_dev = crtc->dev->dev_private;
+	struct fl2000_crc *crc = &fl2000_dev->crc;
+
+	if (!fl2000_crc_source_valid(source))
+		return -EINVAL;
+
+	spin_lock_irq(&crc->lock);
+	crc->enabled = source && strcmp(source, "none");
+	memset(crc->slots, 0, sizeof(crc->slots));
+	crc->next = 0;
+	crc->pending = false;
+	crc->frame = 0;
+	spin_unlock_irq(&crc->lock);
+
+	return 0;
+}
+
+/* Shall be called with CRC lock held */
+static struct fl2000_crc_slot *fl2000_crc_find(struct fl2000_crc *crc, u64 seq)
+{
+	unsigned int i, n;
+
+	/* Most recent first, re-encoded frame keeps its sequence number */
+	for (i = 1; i <= FL2000_CRC_SLOTS; i++) {
+		n = (crc->next + FL2000_CRC_SLOTS - i) % FL2000_CRC_SLOTS;
+		if (crc->slots[n].valid && crc->slots[n].seq == seq)
+			return &crc->slots[n];
+	}
+
+	return NULL;
+}
+
+/**
+ * fl2000_crc_frame() - checksum submitted stream buffer
+ * @fl2000_dev:	FL2000 device
+ * @data:	stream buffer data
+ * @size:	stream buffer size
+ * @seq:	frame sequence number of the buffer
+ *
+ * Shall be called from process context, buffer shall not be changed meanwhile
+ */
+void fl2000_crc_frame(struct fl2000 *fl2000_dev, const void *data, size_t size,
+		      u64 seq)
+{
+	struct fl2000_crc *crc = &fl2000_dev->crc;
+	struct fl2000_crc_slot *slot;
+	bool known;
+	u32 value;
+
+	if (!READ_ONCE(crc->enabled))
+		return;
+
+	/* Format change re-encodes frame keeping its sequence number, but not its size */
+	spin_lock_irq(&crc->lock);
+	slot = fl2000_crc_find(crc, seq);
+	known = slot && slot->size == size;
+	spin_unlock_irq(&crc->lock);
+	if (known)
+		return;
+
+	value = crc32_le(~0, data, size) ^ ~0;
+
+	spin_lock_irq(&crc->lock);
+	slot = &crc->slots[crc->next];
+	crc->next = (crc->next + 1) % FL2000_CRC_SLOTS;
+	slot->seq = seq;
+	slot->size = size;
+	slot->value = value;
+	slot->valid = true;
+	spin_unlock_irq(&crc->lock);
+}
+
+/**
+ * fl2000_crc_shown() - report CRC of the buffer that has reached the device
+ * @fl2000_dev:	FL2000 device
+ * @seq:	frame sequence number of the buffer
+ *
+ * Called from URB completion
+ */
+void fl2000_crc_shown(struct fl2000 *fl2000_dev, u64 seq)
+{
+	struct fl2000_crc *crc = &fl2000_dev->crc;
+	struct drm_crtc *crtc = &fl2000_dev->pipe.crtc;
+	struct fl2000_crc_slot *slot;
+	unsigned long flags;
+	u64 frame;
+
+	if (!READ_ONCE(crc->enabled))
+		return;
+
+	spin_lock_irqsave(&crc->lock, flags);
+
+	slot = fl2000_crc_find(crc, seq);
+	if (!crc->enabled || !slot)
+		goto unlock;
+
+	/* Buffer is scanned out from the next vblank on */
+	frame = drm_crtc_vblank_count(crtc) + 1;
+
+	/* Entries shall be reported for increasing frame numbers */
+	if (crc->pending && frame > crc->pending_frame) {
+		drm_crtc_add_crc_entry(crtc, true, crc->pending_frame,
+				       &crc->pending_value);
+		crc->frame = crc->pending_frame;
+		crc->pending = false;
+	}
+	if (crc->frame && frame <= crc->frame)
+		goto unlock;
+
+	crc->pending = true;
+	crc->pending_frame = frame;
+	crc->pending_value = slot->value;
+
+unlock:
+	spin_unlock_irqrestore(&crc->lock, flags);
+}
+
+/* Shall be called after vblank initialization, which installs CRTC functions copy */
+void fl2000_crc_init(struct fl2000 *fl2000_dev)
+{
+	spin_lock_init(&fl2000_dev->crc.lock);
+
+	fl2000_dev->crtc_funcs.set_crc_source = fl2000_crc_set_source;
+	fl2000_dev->crtc_funcs.verify_crc_source = fl2000_crc_verify_source;
+	fl2000_dev->crtc_funcs.get_crc_sources = fl2000_crc_get_sources;
+}
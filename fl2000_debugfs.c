@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/seq_file.h>
+
+#include <drm/drm_debugfs.h>
+#include <drm/drm_drv.h>
+
+#include "fl2000.h"
+
+/* DRM managed debugfs entries exist since 6.3, older kernels use per minor info lists */
+static struct fl2000 *fl2000_debugfs_dev(struct seq_file *m)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	struct drm_debugfs_entry *entry = m->private;
+
+	return entry->dev->dev_private;
+#else
+	struct drm_info_node *node = m->private;
+
+	return node->minor->dev->dev_private;
+#endif
+}
+
+static int fl2000_debugfs_interrupts_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_intr_stats *stats = &fl2000_dev->intr_stats;
+
+	seq_printf(m, "interrupts:     %llu\n", READ_ONCE(stats->interrupts));
+	seq_printf(m, "sink_events:    %llu\n", READ_ONCE(stats->sink_events));
+	seq_printf(m, "lbuf_overflow:  %llu\n",
+		   READ_ONCE(stats->lbuf_overflow));
+	seq_printf(m, "lbuf_underflow: %llu\n",
+		   READ_ONCE(stats->lbuf_underflow));
+	seq_printf(m, "lbuf_halt:      %llu\n", READ_ONCE(stats->lbuf_halt));
+	seq_printf(m, "vga_error:      %llu\n", READ_ONCE(stats->vga_error));
+	seq_printf(m, "td_drop:        %llu\n", READ_ONCE(stats->td_drop));
+
+	return 0;
+}
+
+static int fl2000_debugfs_lbuf_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	mutex_lock(&lbuf->lock);
+	seq_printf(m, "lo_mark:     %u (+%u lines)\n", lbuf->lo_mark,
+		   lbuf->lo_extra);
+	seq_printf(m, "hi_mark:     %u (-%u lines)\n", lbuf->hi_mark,
+		   lbuf->hi_less);
+	seq_printf(m, "assert_rdy:  %u\n", lbuf->assert_rdy);
+	seq_printf(m, "queue_depth: %u\n", READ_ONCE(fl2000_dev->queue_depth));
+	seq_printf(m, "adjustments: %llu\n", lbuf->adjustments);
+	seq_printf(m, "bytes_pix:   %d (mode %u)\n", fl2000_dev->bytes_pix,
+		   lbuf->mode_bytes_pix);
+	seq_printf(m, "depth:       %llu drops, %llu restores\n",
+		   lbuf->depth_drops, lbuf->depth_restores);
+	seq_printf(m, "settled:     %s\n",
+		   fl2000_lbuf_settled(fl2000_dev) ? "yes" : "no");
+	mutex_unlock(&lbuf->lock);
+
+	seq_printf(m, "recoveries:  %llu (%llu failed)\n",
+		   READ_ONCE(lbuf->recoveries), READ_ONCE(lbuf->recover_failures));
+	seq_printf(m, "recover_us:  last %lld max %lld total %lld\n",
+		   READ_ONCE(lbuf->recover_last_us),
+		   READ_ONCE(lbuf->recover_max_us),
+		   READ_ONCE(lbuf->recover_total_us));
+
+	return 0;
+}
+
+static int fl2000_debugfs_stream_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_stream_errors *errors = &fl2000_dev->stream_errors;
+	struct fl2000_stream_jitter *jitter = &fl2000_dev->stream_jitter;
+	u64 intervals = READ_ONCE(jitter->intervals);
+
+	seq_printf(m, "transport:      %s\n",
+		   fl2000_dev->transport == FL2000_TRANSPORT_ISOC ? "isoc" :
+								    "bulk");
+	if (fl2000_dev->transport == FL2000_TRANSPORT_ISOC)
+		seq_printf(m, "isoc:           alt %u, %u bytes per %u uframe(s), %llu packet errors\n",
+			   fl2000_dev->isoc.altsetting,
+			   fl2000_dev->isoc.packet_size,
+			   fl2000_dev->isoc.interval,
+			   READ_ONCE(fl2000_dev->isoc.packet_errors));
+	else
+		seq_printf(m, "bulk:           alt %u, %u bytes burst\n",
+			   fl2000_dev->bulk.altsetting,
+			   fl2000_dev->bulk.burst);
+	seq_printf(m, "urbs_in_flight: %d\n",
+		   atomic_read(&fl2000_dev->urbs_in_flight));
+	seq_printf(m, "urb_errors:     %llu\n", READ_ONCE(errors->urb_errors));
+	seq_printf(m, "submit_errors:  %llu\n",
+		   READ_ONCE(errors->submit_errors));
+	seq_printf(m, "stalls:         %llu\n", READ_ONCE(errors->stalls));
+	seq_printf(m, "halts_cleared:  %llu\n",
+		   READ_ONCE(errors->halts_cleared));
+	seq_printf(m, "restarts:       %llu\n", READ_ONCE(errors->restarts));
+	seq_printf(m, "backoffs:       %llu\n", READ_ONCE(errors->backoffs));
+	seq_printf(m, "clone_group:    %u%s\n", fl2000_clone_id(fl2000_dev),
+		   fl2000_clone_follower(fl2000_dev) ? " (follower)" : "");
+	seq_printf(m, "tile_flips:     %llu\n",
+		   READ_ONCE(fl2000_dev->tile.flips));
+
+	seq_printf(m, "pacing:         %s, lead %lld us, %llu holds, %llu starved, %llu skipped\n",
+		   fl2000_pacing_active(fl2000_dev) ? "on" : "off",
+		   div_s64(READ_ONCE(fl2000_dev->pacing.lead_ns), NSEC_PER_USEC),
+		   READ_ONCE(fl2000_dev->pacing.holds),
+		   READ_ONCE(fl2000_dev->pacing.starved),
+		   READ_ONCE(fl2000_dev->pacing.skipped));
+
+	seq_printf(m, "intervals:      %llu\n", intervals);
+	seq_printf(m, "sums_us:        interval %llu deviation %llu\n",
+		   READ_ONCE(jitter->sum_us), READ_ONCE(jitter->sum_dev_us));
+	if (intervals > 1) {
+		seq_printf(m, "interval_us:    min %lld avg %llu max %lld\n",
+			   READ_ONCE(jitter->min_us),
+			   div64_u64(READ_ONCE(jitter->sum_us), intervals),
+			   READ_ONCE(jitter->max_us));
+		seq_printf(m, "jitter_us:      %llu\n",
+			   div64_u64(READ_ONCE(jitter->sum_dev_us),
+				     intervals - 1));
+	}
+
+	return 0;
+}
+
+static void fl2000_debugfs_hist(struct seq_file *m, const char *name,
+				struct fl2000_hist *hist)
+{
+	u64 count = READ_ONCE(hist->count);
+	unsigned int i;
+
+	seq_printf(m, "%s_us: %llu samples", name, count);
+	if (count)
+		seq_printf(m, ", avg %llu max %llu",
+			   div64_u64(READ_ONCE(hist->sum_us), count),
+			   READ_ONCE(hist->max_us));
+	seq_putc(m, '\n');
+
+	for (i = 0; i < FL2000_HIST_BUCKETS; i++) {
+		u64 n = READ_ONCE(hist->buckets[i]);
+
+		if (!n)
+			continue;
+		if (i < FL2000_HIST_BUCKETS - 1)
+			seq_printf(m, "  < %6lu: %llu\n", BIT(i), n);
+		else
+			seq_printf(m, "  >=%6lu: %llu\n", BIT(i - 1), n);
+	}
+}
+
+/* Stream pipeline counters and achieved rate against the link budget */
+static int fl2000_debugfs_stats_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_stream_stats *stats = &fl2000_dev->stream_stats;
+	struct list_head *pos;
+	unsigned int render = 0, pending = 0, transmit = 0, wait = 0;
+	u64 bytes = 0, required;
+	s64 us = 0;
+
+	seq_printf(m, "committed:     %llu\n", READ_ONCE(stats->committed));
+	seq_printf(m, "converted:     %llu\n", READ_ONCE(stats->converted));
+	seq_printf(m, "dropped:       %llu\n", READ_ONCE(stats->dropped));
+	seq_printf(m, "retransmitted: %llu\n",
+		   READ_ONCE(stats->retransmitted));
+	seq_printf(m, "urb_errors:    %llu\n",
+		   READ_ONCE(fl2000_dev->stream_errors.urb_errors));
+	seq_printf(m, "bytes:         %llu\n", READ_ONCE(stats->bytes));
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	list_for_each (pos, &fl2000_dev->render_list)
+		render++;
+	list_for_each (pos, &fl2000_dev->pending_list)
+		pending++;
+	list_for_each (pos, &fl2000_dev->transmit_list)
+		transmit++;
+	list_for_each (pos, &fl2000_dev->wait_list)
+		wait++;
+	spin_unlock_irq(&fl2000_dev->list_lock);
+	seq_printf(m, "lists:         render %u, pending %u, transmit %u, wait %u\n",
+		   render, pending, transmit, wait);
+
+	fl2000_debugfs_hist(m, "convert", &stats->convert);
+	fl2000_debugfs_hist(m, "latency", &stats->latency);
+
+	mutex_lock(&fl2000_dev->stream_lock);
+	if (fl2000_dev->enabled) {
+		bytes = READ_ONCE(stats->bytes) - stats->run_bytes;
+		us = ktime_us_delta(ktime_get(), fl2000_dev->stream_start);
+	}
+	mutex_unlock(&fl2000_dev->stream_lock);
+
+	required = (u64)fl2000_dev->pixclock * fl2000_dev->bytes_pix;
+	seq_printf(m, "rate_mbps:     %llu (required %llu, budget %llu)\n",
+		   us > 0 ? div64_u64(bytes * 8, us) : 0,
+		   div_u64(required * 8, 1000000),
+		   div_u64(fl2000_bw_budget(fl2000_dev) * 8, 1000000));
+
+	return 0;
+}
+
+/* Print parts per billion as parts per million */
+static void fl2000_debugfs_ppm(struct seq_file *m, s64 ppb)
+{
+	u32 frac;
+	u64 ppm = div_u64_rem(abs(ppb), 1000, &frac);
+
+	seq_printf(m, "%s%llu.%03u", ppb < 0 ? "-" : "", ppm, frac);
+}
+
+static int fl2000_debugfs_vblank_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	struct fl2000_drift *drift = &fl2000_dev->drift;
+
+	spin_lock_irq(&vblank->lock);
+	seq_printf(m, "enabled:   %s\n", vblank->enabled ? "yes" : "no");
+	seq_printf(m, "period_ns: %lld (nominal %lld)\n",
+		   ktime_to_ns(vblank->period), ktime_to_ns(vblank->nominal));
+	seq_printf(m, "frames:    %llu\n", vblank->frames);
+	seq_printf(m, "hw_frames: %llu\n", vblank->hw_frames);
+	seq_printf(m, "resyncs:   %llu (%llu bogus)\n", vblank->resyncs,
+		   vblank->hw_bogus);
+	seq_printf(m, "offset:    %lld frames, slew %lld ns\n", vblank->offset,
+		   vblank->slew_ns);
+	if (drift->samples) {
+		seq_puts(m, "drift_ppm: ");
+		fl2000_debugfs_ppm(m, drift->ppb);
+		seq_puts(m, " (min ");
+		fl2000_debugfs_ppm(m, drift->ppb_min);
+		seq_puts(m, " max ");
+		fl2000_debugfs_ppm(m, drift->ppb_max);
+		seq_printf(m, ") over %llu s\n",
+			   div_u64(drift->total_ns, NSEC_PER_SEC));
+	}
+	spin_unlock_irq(&vblank->lock);
+
+	seq_printf(m, "biac:      0x%08x\n", READ_ONCE(drift->biac_status));
+
+	return 0;
+}
+
+static int fl2000_debugfs_telemetry_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_telemetry *tm = &fl2000_dev->telemetry;
+	unsigned int i, n;
+
+	spin_lock_irq(&tm->lock);
+	seq_printf(m, "pixclock:       %llu Hz (pll %u Hz", tm->pixclock,
+		   tm->pll_clock);
+	if (tm->pixclock && tm->pll_clock) {
+		seq_puts(m, ", ");
+		fl2000_debugfs_ppm(m, div_s64(((s64)tm->pixclock -
+					       tm->pll_clock) * 1000000000ll,
+					      tm->pll_clock));
+		seq_puts(m, " ppm");
+	}
+	seq_printf(m, ") over %llu ms\n", div_u64(tm->total_ns, NSEC_PER_MSEC));
+	seq_printf(m, "pxclk_cnt:      0x%07x\n", tm->pxclk_cnt);
+	seq_printf(m, "samples:        %llu (%llu skipped)\n", tm->samples,
+		   tm->skipped);
+	seq_printf(m, "watermark:      %u (min %u, lo_mark %u)\n", tm->watermark,
+		   tm->watermark_min, READ_ONCE(fl2000_dev->lbuf.lo_mark));
+	seq_printf(m, "accumulate:     %u (max %u)\n", tm->accumulate,
+		   tm->accumulate_max);
+	seq_printf(m, "aclk_count:     %u%s\n", tm->aclk_count,
+		   tm->aclk_hit ? " (hit)" : "");
+	seq_printf(m, "near_underflow: %llu\n", tm->near_underflow);
+
+	/* Watermarks of the latest samples, oldest first */
+	n = min_t(u64, tm->samples, FL2000_TELEMETRY_HISTORY);
+	seq_puts(m, "history:       ");
+	for (i = tm->head + FL2000_TELEMETRY_HISTORY - n; n; n--, i++)
+		seq_printf(m, " %u", tm->history[i % FL2000_TELEMETRY_HISTORY]);
+	seq_putc(m, '\n');
+	spin_unlock_irq(&tm->lock);
+
+	return 0;
+}
+
+/* Sustained throughput of bulk altsettings, accounted when stream stops */
+static int fl2000_debugfs_throughput_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_bulk_stats *stats;
+	unsigned int i;
+
+	mutex_lock(&fl2000_dev->stream_lock);
+	for (i = 0; i < FL2000_BULK_ALTS_MAX; i++) {
+		stats = &fl2000_dev->bulk.stats[i];
+		if (stats->us <= 0)
+			continue;
+		seq_printf(m, "alt %u: %llu bytes in %lld us, %llu B/s\n", i,
+			   stats->bytes, stats->us,
+			   div64_u64(stats->bytes * USEC_PER_SEC, stats->us));
+	}
+	mutex_unlock(&fl2000_dev->stream_lock);
+
+	return 0;
+}
+
+static int fl2000_debugfs_probe_show(struct seq_file *m, void *data)
+{
+	struct fl2000 *fl2000_dev = fl2000_debugfs_dev(m);
+	struct fl2000_probe_times *times = &fl2000_dev->probe_times;
+
+	seq_printf(m, "start_us: %lld\n", ktime_to_us(times->start));
+	seq_printf(m, "probe_us: %lld\n", times->probe_us);
+	seq_printf(m, "ready_us: %lld\n", READ_ONCE(times->ready_us));
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static const struct drm_debugfs_info fl2000_debugfs_list[] = {
+#else
+static const struct drm_info_list fl2000_debugfs_list[] = {
+#endif
+	{ "interrupts", fl2000_debugfs_interrupts_show, 0 },
+	{ "lbuf", fl2000_debugfs_lbuf_show, 0 },
+	{ "stream", fl2000_debugfs_stream_show, 0 },
+	{ "stats", fl2000_debugfs_stats_show, 0 },
+	{ "throughput", fl2000_debugfs_throughput_show, 0 },
+	{ "vblank", fl2000_debugfs_vblank_show, 0 },
+	{ "telemetry", fl2000_debugfs_telemetry_show, 0 },
+	{ "probe", fl2000_debugfs_probe_show, 0 },
+};
+
+/* Shall be called before DRM device registration */
+void fl2000_debugfs_init(struct fl2000 *fl2000_dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	drm_debugfs_add_files(&fl2000_dev->drm, fl2000_debugfs_list,
+			      ARRAY_SIZE(fl2000_debugfs_list));
+#endif
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+/* Called by DRM on registration, once debugfs directory of the minor exists */
+void fl2000_debugfs_minor_init(struct drm_minor *minor)
+{
+	drm_debugfs_create_files(fl2000_debugfs_list,
+				 ARRAY_SIZE(fl2000_debugfs_list),
+				 minor->debugfs_root, minor);
+}
+#endif
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Pixel clock of the device and host clock drift apart, so the output consumes frames slightly
+ * faster or slower than nominal rate. Drift is measured from hardware frame counter over a long
+ * window, where USB latency of individual samples averages out, and compensated frame period is
+ * used by vblank timer and frame pacing. Older measurements are gradually forgotten, so slow
+ * changes e.g. with temperature are followed.
+ *
+ * BIAC registers look related to frame timing against USB microframes, but their semantics are not
+ * documented. Status is only sampled and shown along with the drift, control is left as is.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/math64.h>
+
+#include "fl2000.h"
+
+/* Measurement window shorter than that is dominated by sampling latency, s */
+#define FL2000_DRIFT_WINDOW_MIN_S 10
+
+/* Measurement window is halved once it reaches that, s */
+#define FL2000_DRIFT_WINDOW_MAX_S 600
+
+#define FL2000_PPB 1000000000ll
+
+/**
+ * fl2000_drift_update() - account frame counter measurement
+ * @fl2000_dev:	FL2000 device
+ * @elapsed:	host time of the measurement window
+ * @frames:	frames output within the window
+ * @nominal:	nominal frame period
+ *
+ * Windows shall be contiguous. Can be called from atomic context, shall be serialized by caller
+ *
+ * Return: Compensated frame period, nominal one while there is not enough data
+ */
+ktime_t fl2000_drift_update(struct fl2000 *fl2000_dev, ktime_t elapsed,
+			    u32 frames, ktime_t nominal)
+{
+	struct fl2000_drift *drift = &fl2000_dev->drift;
+	u64 expected;
+
+	drift->total_ns += ktime_to_ns(elapsed);
+	drift->total_frames += frames;
+
+	if (drift->total_ns > FL2000_DRIFT_WINDOW_MAX_S * NSEC_PER_SEC) {
+		drift->total_ns >>= 1;
+		drift->total_frames >>= 1;
+	}
+
+	if (drift->total_ns < FL2000_DRIFT_WINDOW_MIN_S * NSEC_PER_SEC ||
+	    !drift->total_frames)
+		return nominal;
+
+	/* Positive drift means pixel clock is faster than nominal */
+	expected = drift->total_frames * ktime_to_ns(nominal);
+	drift->ppb = div64_s64(((s64)expected - (s64)drift->total_ns) *
+				       (FL2000_PPB / 1000),
+			       div_u64(drift->total_ns, 1000));
+
+	if (!drift->samples++) {
+		drift->ppb_min = drift->ppb;
+		drift->ppb_max = drift->ppb;
+	} else {
+		drift->ppb_min = min(drift->ppb_min, drift->ppb);
+		drift->ppb_max = max(drift->ppb_max, drift->ppb);
+	}
+
+	return ns_to_ktime(div64_u64(drift->total_ns, drift->total_frames));
+}
+
+/* Measurement chain is broken, e.g. with a modeset. Shall be serialized with updates */
+void fl2000_drift_reset(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_drift *drift = &fl2000_dev->drift;
+
+	drift->total_ns = 0;
+	drift->total_frames = 0;
+}
+
+/* Shall be called from process context */
+void fl2000_drift_poll(struct fl2000 *fl2000_dev)
+{
+	struct regmap *regmap = fl2000_dev->regmap;
+	union fl2000_cfg_biac_status_reg status;
+
+	if (regmap_read(regmap, FL2000_BIAC_STATUS_REG, &status.val))
+		return;
+
+	WRITE_ONCE(fl2000_dev->drift.biac_status, status.val);
+}
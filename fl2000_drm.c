@@ -7,9 +7,11 @@
 #include <linux/version.h>
 #include <linux/dma-buf.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
 #include <linux/usb.h>
 
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_atomic_state_helper.h>
 #include <drm/drm_damage_helper.h>
 #include <drm/drm_drv.h>
 #include <drm/drm_fb_helper.h>
@@ -27,6 +29,7 @@
 #include <drm/drm_vblank.h>
 
 #include "fl2000.h"
+#include "fl2000_trace.h"
 
 #define DRM_DRIVER_NAME "fl2000_drm"
 #define DRM_DRIVER_DESC "USB-VGA/HDMI"
@@ -64,43 +67,16 @@ static const u32 fl2000_pixel_formats[] = {
 /* Maximum acceptable ppm error */
 #define FL2000_PPM_ERR_MAX 500
 
-/* Assume bulk transfers can use only 80% of USB bandwidth */
-#define FL2000_BULK_BW_PERCENT 100
-
-#define FL2000_BULK_BW_HIGH_SPEED                                              \
-	(480000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
-#define FL2000_BULK_BW_SUPER_SPEED                                             \
-	(5000000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
-#define FL2000_BULK_BW_SUPER_SPEED_PLUS                                        \
-	(10000000000ull * FL2000_BULK_BW_PERCENT / 100 / 8)
-
-static u32 fl2000_get_bytes_pix(enum usb_device_speed speed, u32 pixclock)
-{
-	int bytes_pix;
-	u64 max_bw;
-
-	/* Calculate maximum bandwidth, bytes per second */
-	switch (speed) {
-	case USB_SPEED_HIGH:
-		max_bw = FL2000_BULK_BW_HIGH_SPEED;
-		break;
-	case USB_SPEED_SUPER:
-		max_bw = FL2000_BULK_BW_SUPER_SPEED;
-		break;
-	case USB_SPEED_SUPER_PLUS:
-		max_bw = FL2000_BULK_BW_SUPER_SPEED_PLUS;
-		break;
-	default:
-		return 0;
-	}
+/* Output depth that fits into the bandwidth budget is picked at atomic check and carried with
+ * the state, so that bandwidth is reserved only if the state gets committed
+ */
+struct fl2000_crtc_state {
+	struct drm_crtc_state base;
+	u32 bytes_pix;
+};
 
-	/* Maximum bytes per pixel with maximum bandwidth */
-	bytes_pix = max_bw / pixclock;
-	if (bytes_pix > 3) {
-		bytes_pix = 3;
-	}
-	return bytes_pix;
-}
+#define to_fl2000_crtc_state(state)                                            \
+	container_of(state, struct fl2000_crtc_state, base)
 
 static struct drm_gem_object *fl2000_gem_prime_import(struct drm_device *dev,
 						      struct dma_buf *dma_buf)
@@ -118,6 +94,14 @@ DEFINE_DRM_GEM_FOPS(fl2000_drm_driver_fops);
 const struct drm_driver fl2000_drm_driver = {
 	.driver_features = DRIVER_MODESET | DRIVER_GEM | DRIVER_ATOMIC,
 	.lastclose = drm_fb_helper_lastclose,
+	.open = fl2000_fdinfo_open,
+	.postclose = fl2000_fdinfo_postclose,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.show_fdinfo = fl2000_fdinfo_show,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	.debugfs_init = fl2000_debugfs_minor_init,
+#endif
 
 	.fops = &fl2000_drm_driver_fops,
 
@@ -133,7 +117,7 @@ const struct drm_driver fl2000_drm_driver = {
 };
 
 static const struct drm_mode_config_funcs fl2000_mode_config_funcs = {
-	.fb_create = drm_gem_fb_create_with_dirty,
+	.fb_create = fl2000_fdinfo_fb_create,
 	.atomic_check = drm_atomic_helper_check,
 	.atomic_commit = drm_atomic_helper_commit,
 };
@@ -281,13 +265,13 @@ fl2000_display_mode_valid(struct drm_simple_display_pipe *pipe,
 	struct drm_display_mode adjusted_mode;
 	struct fl2000_pll pll;
 	struct fl2000 *fl2000_dev = drm->dev_private;
-	struct usb_device *usb_dev = fl2000_dev->usb_dev;
 
 	/* Get PLL configuration and check if mode adjustments needed */
 	if (fl2000_mode_calc(mode, &adjusted_mode, &pll))
 		return MODE_BAD;
 
-	if (!fl2000_get_bytes_pix(usb_dev->speed, adjusted_mode.clock * 1000))
+	/* Mode list does not depend on other devices, shared budget is checked on modeset */
+	if (!fl2000_bw_bytes_pix(fl2000_dev, adjusted_mode.clock * 1000, false))
 		return MODE_BAD;
 
 	return MODE_OK;
@@ -298,19 +282,34 @@ static void fl2000_output_mode_set(struct fl2000 *fl2000_dev,
 				   struct drm_display_mode *adjusted_mode)
 {
 	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	struct fl2000_crtc_state *state;
 	struct fl2000_timings timings;
 	struct fl2000_pll pll;
-	u32 bytes_pix;
+	u32 bytes_pix, pll_clock;
 
 	/* Get PLL configuration and cehc if mode adjustments needed */
 	if (fl2000_mode_calc(mode, adjusted_mode, &pll))
 		return;
 
-	/* Check how many bytes per pixel shall be used with adjusted clock */
-	bytes_pix = fl2000_get_bytes_pix(usb_dev->speed,
-					 adjusted_mode->clock * 1000);
-	if (!bytes_pix)
+	/* Depth was picked at atomic check. Another device on the link may have reserved bandwidth
+	 * since then, settle for a lower depth in that case
+	 */
+	state = to_fl2000_crtc_state(fl2000_dev->pipe.crtc.state);
+	bytes_pix = min(state->bytes_pix,
+			fl2000_bw_bytes_pix(fl2000_dev, adjusted_mode->clock * 1000,
+					    true));
+	if (!bytes_pix ||
+	    fl2000_bw_reserve(fl2000_dev,
+			      (u64)adjusted_mode->clock * 1000 * bytes_pix)) {
+		dev_err(&usb_dev->dev, "Not enough USB bandwidth for the mode");
 		return;
+	}
+	fl2000_dev->pixclock = adjusted_mode->clock * 1000;
+
+	/* Vblank timer runs at the frame rate of the output, mode clock is rounded to kHz */
+	pll_clock = FL2000_XTAL / pll.prescaler * pll.multiplier / pll.divisor;
+	fl2000_vblank_mode_set(fl2000_dev, adjusted_mode, pll_clock);
+	fl2000_telemetry_mode_set(fl2000_dev, pll_clock);
 
 	dev_dbg(&usb_dev->dev, "Mode requested:  " DRM_MODE_FMT,
 		DRM_MODE_ARG(mode));
@@ -341,6 +340,9 @@ static void fl2000_output_mode_set(struct fl2000 *fl2000_dev,
 	/* Pixel format according to number of bytes per pixel */
 	fl2000_set_pixfmt(usb_dev, bytes_pix);
 
+	/* Line buffer watermarks depend on line length */
+	fl2000_lbuf_mode_set(fl2000_dev, timings.hactive, bytes_pix);
+
 	/* Configure frame transfers */
 	fl2000_set_transfers(usb_dev);
 
@@ -349,10 +351,44 @@ static void fl2000_output_mode_set(struct fl2000 *fl2000_dev,
 
 	fl2000_afe_magic(usb_dev);
 
-	fl2000_stream_mode_set(fl2000_dev, mode->hdisplay * mode->vdisplay,
+	fl2000_stream_mode_set(fl2000_dev, mode->hdisplay, mode->vdisplay,
 			       bytes_pix);
 }
 
+/**
+ * fl2000_output_restore() - restore output configuration after device has lost its state
+ * @fl2000_dev:	FL2000 device
+ *
+ * Replays register cache and re-applies volatile configuration of the stream transport and of the
+ * current mode, if any: pixel format with the current output depth and line buffer watermarks. DRM
+ * state is not touched
+ *
+ * Return: Operation result
+ */
+int fl2000_output_restore(struct fl2000 *fl2000_dev)
+{
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	int ret;
+
+	ret = fl2000_restore(usb_dev);
+	if (ret)
+		return ret;
+
+	fl2000_set_isoc(usb_dev,
+			fl2000_dev->transport == FL2000_TRANSPORT_ISOC);
+
+	/* Nothing else to restore before the first modeset */
+	if (!fl2000_dev->bytes_pix)
+		return 0;
+
+	/* Output depth may have been lowered since modeset */
+	fl2000_set_pixfmt(usb_dev, fl2000_dev->bytes_pix);
+	fl2000_set_transfers(usb_dev);
+	fl2000_lbuf_restore(fl2000_dev);
+
+	return 0;
+}
+
 static void fl2000_display_enable(struct drm_simple_display_pipe *pipe,
 				  struct drm_crtc_state *cstate,
 				  struct drm_plane_state *plane_state)
@@ -383,6 +419,9 @@ static void fl2000_display_disable(struct drm_simple_display_pipe *pipe)
 	drm_crtc_vblank_off(crtc);
 
 	fl2000_stream_disable(fl2000_dev);
+
+	/* Let other devices on the same link use the bandwidth */
+	fl2000_bw_reserve(fl2000_dev, 0);
 }
 
 static int fl2000_display_check(struct drm_simple_display_pipe *pipe,
@@ -391,7 +430,11 @@ static int fl2000_display_check(struct drm_simple_display_pipe *pipe,
 {
 	struct drm_crtc *crtc = &pipe->crtc;
 	struct drm_device *drm = crtc->dev;
+	struct fl2000 *fl2000_dev = drm->dev_private;
 	struct drm_framebuffer *fb = plane_state->fb;
+	struct drm_display_mode adjusted_mode;
+	struct fl2000_pll pll;
+	u32 bytes_pix;
 	int n;
 
 	n = fb->format->num_planes;
@@ -401,24 +444,102 @@ static int fl2000_display_check(struct drm_simple_display_pipe *pipe,
 			n);
 		return -EINVAL;
 	}
+
+	if (!crtc_state->active || !drm_atomic_crtc_needs_modeset(crtc_state))
+		return 0;
+
+	/* Refuse the mode if it does not fit next to streams of other devices on the same link */
+	if (fl2000_mode_calc(&crtc_state->mode, &adjusted_mode, &pll))
+		return -EINVAL;
+	bytes_pix = fl2000_bw_bytes_pix(fl2000_dev, adjusted_mode.clock * 1000,
+					true);
+	if (!bytes_pix) {
+		drm_dbg_kms(drm, "Not enough USB bandwidth for " DRM_MODE_FMT,
+			    DRM_MODE_ARG(&crtc_state->mode));
+		return -ENOSPC;
+	}
+
+	/* Nothing is reserved here, state may be checked only or dropped by a later check */
+	to_fl2000_crtc_state(crtc_state)->bytes_pix = bytes_pix;
+
 	return 0;
 }
 
+static void fl2000_display_destroy_crtc_state(struct drm_simple_display_pipe *pipe,
+					      struct drm_crtc_state *crtc_state)
+{
+	__drm_atomic_helper_crtc_destroy_state(crtc_state);
+	kfree(to_fl2000_crtc_state(crtc_state));
+}
+
+static void fl2000_display_reset_crtc(struct drm_simple_display_pipe *pipe)
+{
+	struct drm_crtc *crtc = &pipe->crtc;
+	struct fl2000_crtc_state *state;
+
+	if (crtc->state)
+		fl2000_display_destroy_crtc_state(pipe, crtc->state);
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	__drm_atomic_helper_crtc_reset(crtc, state ? &state->base : NULL);
+}
+
+static struct drm_crtc_state *
+fl2000_display_duplicate_crtc_state(struct drm_simple_display_pipe *pipe)
+{
+	struct drm_crtc *crtc = &pipe->crtc;
+	struct fl2000_crtc_state *state;
+
+	if (WARN_ON(!crtc->state))
+		return NULL;
+
+	state = kmemdup(to_fl2000_crtc_state(crtc->state), sizeof(*state),
+			GFP_KERNEL);
+	if (!state)
+		return NULL;
+
+	__drm_atomic_helper_crtc_duplicate_state(crtc, &state->base);
+
+	return &state->base;
+}
+
 static void fb2000_dirty(struct drm_framebuffer *fb,
-			 const struct iosys_map *map, struct drm_rect *rect)
+			 const struct iosys_map *map,
+			 struct drm_plane_state *state)
 {
 	int ret;
 	struct drm_device *drm = fb->dev;
 	struct fl2000 *fl2000_dev = drm->dev_private;
+	ktime_t start;
+	unsigned int x = state->src.x1 >> 16;
+	unsigned int y = state->src.y1 >> 16;
+	unsigned int width = drm_rect_width(&state->src) >> 16;
+	unsigned int height = drm_rect_height(&state->src) >> 16;
+	u64 seq = ++fl2000_dev->frame_seq;
+
+	trace_fl2000_dirty(fl2000_dev->usb_dev, seq, x, y, width, height);
+	fl2000_dev->stream_stats.committed++;
+
+	/* Clone group leader converts the same picture for this device */
+	if (fl2000_clone_follower(fl2000_dev))
+		return;
 
 	ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
 	if (ret)
 		return;
 
-	fl2000_stream_compress(fl2000_dev, map->vaddr, fb->height, fb->width,
-			       fb->pitches[0]);
+	/* Only plane source is shown, e.g. own tile of a large shared framebuffer */
+	start = ktime_get();
+	fl2000_stream_compress(fl2000_dev,
+			       map->vaddr + y * fb->pitches[0] +
+				       x * fb->format->cpp[0],
+			       height, width, fb->pitches[0], seq);
+	fl2000_fdinfo_account(fl2000_dev, fb,
+			      ktime_to_ns(ktime_sub(ktime_get(), start)));
 
 	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+
+	fl2000_tile_commit(fl2000_dev);
 }
 
 static void fl2000_display_update(struct drm_simple_display_pipe *pipe,
@@ -430,7 +551,7 @@ static void fl2000_display_update(struct drm_simple_display_pipe *pipe,
 	struct drm_shadow_plane_state *shadow_plane_state =
 		to_drm_shadow_plane_state(state);
 	struct drm_rect rect;
-   	struct drm_pending_vblank_event *event = crtc->state->event;
+	struct drm_pending_vblank_event *event = crtc->state->event;
 	int idx;
 
 	if (!drm_dev_enter(drm, &idx)) {
@@ -439,7 +560,7 @@ static void fl2000_display_update(struct drm_simple_display_pipe *pipe,
 	}
 
 	if (drm_atomic_helper_damage_merged(old_state, state, &rect))
-		fb2000_dirty(state->fb, &shadow_plane_state->data[0], &rect);
+		fb2000_dirty(state->fb, &shadow_plane_state->data[0], state);
 
 	drm_dev_exit(idx);
 
@@ -462,6 +583,11 @@ static const struct drm_simple_display_pipe_funcs fl2000_display_funcs = {
 	.disable = fl2000_display_disable,
 	.check = fl2000_display_check,
 	.update = fl2000_display_update,
+	.enable_vblank = fl2000_vblank_enable,
+	.disable_vblank = fl2000_vblank_disable,
+	.reset_crtc = fl2000_display_reset_crtc,
+	.duplicate_crtc_state = fl2000_display_duplicate_crtc_state,
+	.destroy_crtc_state = fl2000_display_destroy_crtc_state,
 	DRM_GEM_SIMPLE_DISPLAY_PIPE_SHADOW_PLANE_FUNCS
 };
 
@@ -478,6 +604,27 @@ static const struct drm_encoder_helper_funcs fl2000_encoder_funcs = {
 	.mode_set = fl2000_encoder_mode_set,
 };
 
+static void fl2000_init_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, init_work);
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	struct drm_device *drm = &fl2000_dev->drm;
+	struct fl2000_probe_times *times = &fl2000_dev->probe_times;
+
+	/* Initial fbdev configuration probes connector and reads EDID */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+	drm_fbdev_ttm_setup(drm, FL2000_FB_BPP);
+#else
+	drm_fbdev_generic_setup(drm, FL2000_FB_BPP);
+#endif
+
+	times->ready_us = ktime_us_delta(ktime_get(), times->start);
+
+	dev_dbg(&usb_dev->dev, "Probe started at %lld us, probed in %lld us, ready in %lld us",
+		ktime_to_us(times->start), times->probe_us, times->ready_us);
+}
+
 /* TODO: release on errors! */
 int fl2000_drm_init(struct fl2000 *fl2000_dev)
 {
@@ -492,6 +639,8 @@ int fl2000_drm_init(struct fl2000 *fl2000_dev)
 	drm = &fl2000_dev->drm;
 	drm->dev_private = fl2000_dev;
 
+	INIT_WORK(&fl2000_dev->init_work, &fl2000_init_work);
+
 	fl2000_dev->dmadev = usb_intf_get_dma_device(if_stream);
 	if (!fl2000_dev->dmadev)
 		drm_warn(drm,
@@ -533,14 +682,25 @@ int fl2000_drm_init(struct fl2000 *fl2000_dev)
 		goto err_put_dmadev;
 	}
 
+	fl2000_vblank_init(fl2000_dev);
+	fl2000_crc_init(fl2000_dev);
+	fl2000_fdinfo_init(fl2000_dev);
+
 	/* Register 'mode_set' function to operate prior to bridge */
 	drm_encoder_helper_add(&fl2000_dev->pipe.encoder,
 			       &fl2000_encoder_funcs);
 
+	ret = fl2000_bw_init(fl2000_dev);
+	if (ret)
+		goto err_put_dmadev;
+
+	fl2000_lbuf_init(fl2000_dev);
+	fl2000_tile_init(fl2000_dev);
+
 	/* Start streaming interface */
 	ret = fl2000_stream_create(fl2000_dev);
 	if (ret)
-		goto err_put_dmadev;
+		goto err_bw_release;
 
 	/* Start interrupts interface */
 	ret = fl2000_intr_create(fl2000_dev);
@@ -562,27 +722,41 @@ int fl2000_drm_init(struct fl2000 *fl2000_dev)
 
 	drm_plane_enable_fb_damage_clips(&fl2000_dev->pipe.plane);
 
+	fl2000_debugfs_init(fl2000_dev);
+
+	/* HW shall be reset before the first modeset, which may come right after registration */
+	fl2000_reset(usb_dev);
+	fl2000_usb_magic(usb_dev);
+
+	/* Calibration shall not share the link with a stream, so it cannot wait for the init work
+	 * once userspace can modeset. Burst data shall not be taken for a part of the first frame
+	 */
+	fl2000_calibrate(fl2000_dev);
+	if (fl2000_dev->link_bw)
+		fl2000_lbuf_reset(usb_dev);
+
 	ret = drm_dev_register(drm, 0);
 	if (ret) {
 		dev_err(drm->dev, "Cannot register DRM device (%d)", ret);
 		goto err_intr_release;
 	}
 
-	fl2000_reset(usb_dev);
-	fl2000_usb_magic(usb_dev);
+	fl2000_dev->probe_times.probe_us =
+		ktime_us_delta(ktime_get(), fl2000_dev->probe_times.start);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
-	drm_fbdev_ttm_setup(drm, FL2000_FB_BPP);
-#else
-	drm_fbdev_generic_setup(drm, FL2000_FB_BPP);
-#endif
+	/* EDID read and fbdev setup are slow, do not hold probe */
+	queue_work(system_unbound_wq, &fl2000_dev->init_work);
 
 	return 0;
 
 err_intr_release:
+	fl2000_vblank_release(fl2000_dev);
 	fl2000_intr_release(fl2000_dev);
+	fl2000_lbuf_release(fl2000_dev);
 err_stream_release:
 	fl2000_stream_release(fl2000_dev);
+err_bw_release:
+	fl2000_bw_release(fl2000_dev);
 err_put_dmadev:
 	put_device(fl2000_dev->dmadev);
 	return ret;
@@ -592,7 +766,14 @@ void fl2000_drm_release(struct fl2000 *fl2000_dev)
 {
 	struct drm_device *drm = &fl2000_dev->drm;
 
+	cancel_work_sync(&fl2000_dev->init_work);
+
 	drm_crtc_vblank_off(&fl2000_dev->pipe.crtc);
+	fl2000_vblank_release(fl2000_dev);
+
+	/* No other device shall pick up stream buffers of this one */
+	fl2000_clone_release(fl2000_dev);
+	fl2000_tile_release(fl2000_dev);
 
 	/* Stop streaming interface */
 	fl2000_stream_release(fl2000_dev);
@@ -600,10 +781,15 @@ void fl2000_drm_release(struct fl2000 *fl2000_dev)
 	/* Stop interrupts interface */
 	fl2000_intr_release(fl2000_dev);
 
+	fl2000_lbuf_release(fl2000_dev);
+
+	fl2000_bw_release(fl2000_dev);
+
 	/* Prepare to DRM device shutdown */
 	drm_kms_helper_poll_fini(drm);
 	drm_dev_unplug(drm);
 	drm_atomic_helper_shutdown(drm);
+	fl2000_fdinfo_release(fl2000_dev);
 
 	put_device(fl2000_dev->dmadev);
 	fl2000_dev->dmadev = NULL;
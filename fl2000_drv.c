@@ -10,10 +10,13 @@
 #include <linux/usb.h>
 
 #include <drm/drm_managed.h>
-#include <drm/drm_modeset_helper.h>
+#include <drm/drm_probe_helper.h>
 
 #include "fl2000.h"
 
+#define CREATE_TRACE_POINTS
+#include "fl2000_trace.h"
+
 #define USB_DRIVER_NAME "fl2000_usb"
 
 #define USB_CLASS_AV 0x10
@@ -26,6 +29,12 @@
 
 static struct usb_driver fl2000_driver;
 
+/* Streaming is latency sensitive, so its work shall not wait behind anything else. Both queues are
+ * unbound, so work of different devices is spread over CPUs by the scheduler
+ */
+struct workqueue_struct *fl2000_stream_wq;
+struct workqueue_struct *fl2000_event_wq;
+
 static int fl2000_probe(struct usb_interface *interface,
 			const struct usb_device_id *usb_dev_id)
 {
@@ -34,6 +43,7 @@ static int fl2000_probe(struct usb_interface *interface,
 	struct usb_device *usb_dev = interface_to_usbdev(interface);
 	struct usb_interface *if_stream, *if_interrupt;
 	struct fl2000 *fl2000_dev;
+	ktime_t start = ktime_get();
 
 	if (iface_num != FL2000_USBIF_AVCONTROL)
 		return -ENODEV;
@@ -54,6 +64,7 @@ static int fl2000_probe(struct usb_interface *interface,
 			PTR_ERR(fl2000_dev));
 		return PTR_ERR(fl2000_dev);
 	}
+	fl2000_dev->probe_times.start = start;
 
 	fl2000_dev->regmap = fl2000_regmap_init(usb_dev);
 	if (IS_ERR(fl2000_dev->regmap))
@@ -123,21 +134,245 @@ static void fl2000_disconnect(struct usb_interface *interface)
 	fl2000_drm_release(fl2000_dev);
 }
 
-static int fl2000_suspend(struct usb_interface *interface, pm_message_t message)
+/* Stop all device activity keeping stream buffers, DRM state and register cache */
+static void fl2000_quiesce(struct fl2000 *fl2000_dev)
+{
+	drm_kms_helper_poll_disable(&fl2000_dev->drm);
+
+	fl2000_stream_pause(fl2000_dev);
+	fl2000_intr_stop(fl2000_dev);
+
+	/* Keep register writes in cache until device is back */
+	regcache_cache_only(fl2000_dev->regmap, true);
+}
+
+/* Restart device activity, with stream continuing from the last frame */
+static void fl2000_restart(struct fl2000 *fl2000_dev, bool lost_state)
 {
+	int ret;
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	ktime_t start = ktime_get();
+
+	if (lost_state) {
+		ret = fl2000_output_restore(fl2000_dev);
+	} else {
+		regcache_cache_only(fl2000_dev->regmap, false);
+		regcache_mark_dirty(fl2000_dev->regmap);
+		ret = regcache_sync(fl2000_dev->regmap);
+	}
+	if (ret)
+		dev_err(&usb_dev->dev, "Cannot restore registers (%d)", ret);
+
+	ret = fl2000_intr_start(fl2000_dev);
+	if (ret)
+		dev_err(&usb_dev->dev, "Cannot restart interrupts (%d)", ret);
+
+	fl2000_stream_resume(fl2000_dev);
+
+	drm_kms_helper_poll_enable(&fl2000_dev->drm);
+
+	dev_dbg(&usb_dev->dev, "Restarted in %lld us",
+		ktime_us_delta(ktime_get(), start));
+}
+
+/* Whole device is handled via its control interface */
+static struct fl2000 *fl2000_get_dev(struct usb_interface *interface)
+{
+	u8 iface_num = interface->cur_altsetting->desc.bInterfaceNumber;
 	struct usb_device *usb_dev = interface_to_usbdev(interface);
-	struct fl2000 *fl2000_dev = dev_get_drvdata(&usb_dev->dev);
 
-	return drm_mode_config_helper_suspend(&fl2000_dev->drm);
+	if (iface_num != FL2000_USBIF_AVCONTROL)
+		return NULL;
+
+	return dev_get_drvdata(&usb_dev->dev);
+}
+
+static int fl2000_pre_reset(struct usb_interface *interface)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(interface);
+
+	if (fl2000_dev)
+		fl2000_quiesce(fl2000_dev);
+
+	return 0;
+}
+
+static int fl2000_post_reset(struct usb_interface *interface)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(interface);
+
+	if (fl2000_dev)
+		fl2000_restart(fl2000_dev, true);
+
+	return 0;
+}
+
+static int fl2000_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(interface);
+
+	if (fl2000_dev)
+		fl2000_quiesce(fl2000_dev);
+
+	return 0;
 }
 
+/* Device kept its state, so there is no need in reset and PLL relock */
 static int fl2000_resume(struct usb_interface *interface)
 {
-	struct usb_device *usb_dev = interface_to_usbdev(interface);
-	struct fl2000 *fl2000_dev = dev_get_drvdata(&usb_dev->dev);
+	struct fl2000 *fl2000_dev = fl2000_get_dev(interface);
+
+	if (fl2000_dev)
+		fl2000_restart(fl2000_dev, false);
+
+	return 0;
+}
+
+static int fl2000_reset_resume(struct usb_interface *interface)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(interface);
+
+	if (fl2000_dev)
+		fl2000_restart(fl2000_dev, true);
+
+	return 0;
+}
+
+/* Devices in the same clone group show the same picture, 0 means no group */
+static ssize_t clone_group_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	return sysfs_emit(buf, "%u\n", fl2000_clone_id(fl2000_dev));
+}
+
+static ssize_t clone_group_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+	u32 id;
+	int ret;
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	ret = kstrtou32(buf, 0, &id);
+	if (ret)
+		return ret;
+
+	ret = fl2000_clone_join(fl2000_dev, id);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static DEVICE_ATTR_RW(clone_group);
+
+/* Place in a tiled group: "<group> <cols> <rows> <col> <row> <width> <height>", "0" to leave */
+static ssize_t tile_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+	struct fl2000_tile_cfg cfg;
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	fl2000_tile_get(fl2000_dev, &cfg);
+
+	return sysfs_emit(buf, "%u %u %u %u %u %u %u\n", cfg.id, cfg.cols,
+			  cfg.rows, cfg.col, cfg.row, cfg.width, cfg.height);
+}
+
+static ssize_t tile_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+	struct fl2000_tile_cfg cfg = {};
+	int ret;
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	ret = sscanf(buf, "%u %u %u %u %u %u %u", &cfg.id, &cfg.cols,
+		     &cfg.rows, &cfg.col, &cfg.row, &cfg.width, &cfg.height);
+	if (ret != 7 && !(ret == 1 && !cfg.id))
+		return -EINVAL;
+
+	ret = fl2000_tile_set(fl2000_dev, &cfg);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static DEVICE_ATTR_RW(tile);
+
+/* Measured bulk throughput of the link in bytes per second, 0 if not calibrated */
+static ssize_t link_bandwidth_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	return sysfs_emit(buf, "%llu\n", READ_ONCE(fl2000_dev->link_bw));
+}
+static DEVICE_ATTR_RO(link_bandwidth);
+
+static const char *const fl2000_transport_names[] = {
+	[FL2000_TRANSPORT_BULK] = "bulk",
+	[FL2000_TRANSPORT_ISOC] = "isoc",
+};
+
+/* Stream transport, can be changed only while output is disabled */
+static ssize_t transport_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	return sysfs_emit(buf, "%s\n",
+			  fl2000_transport_names[fl2000_dev->transport]);
+}
 
-	return drm_mode_config_helper_resume(&fl2000_dev->drm);
+static ssize_t transport_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct fl2000 *fl2000_dev = fl2000_get_dev(to_usb_interface(dev));
+	int ret;
+
+	if (!fl2000_dev)
+		return -ENODEV;
+
+	ret = sysfs_match_string(fl2000_transport_names, buf);
+	if (ret < 0)
+		return ret;
+
+	ret = fl2000_stream_set_transport(fl2000_dev, ret);
+	if (ret)
+		return ret;
+
+	return count;
 }
+static DEVICE_ATTR_RW(transport);
+
+static struct attribute *fl2000_attrs[] = {
+	&dev_attr_clone_group.attr,
+	&dev_attr_tile.attr,
+	&dev_attr_transport.attr,
+	&dev_attr_link_bandwidth.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(fl2000);
 
 static struct usb_device_id fl2000_id_table[] = {
 	{ USB_DEVICE(USB_VENDOR_FRESCO_LOGIC, USB_PRODUCT_FL2000) },
@@ -149,16 +384,62 @@ static struct usb_driver fl2000_driver = {
 	.name = USB_DRIVER_NAME,
 	.probe = fl2000_probe,
 	.disconnect = fl2000_disconnect,
+	.pre_reset = fl2000_pre_reset,
+	.post_reset = fl2000_post_reset,
 	.id_table = fl2000_id_table,
+	.dev_groups = fl2000_groups,
 	.supports_autosuspend = false,
 	.disable_hub_initiated_lpm = true,
+	/* Probe does not depend on other devices, so multiple dongles come up in parallel */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#else
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 #ifdef CONFIG_PM
 	.suspend = fl2000_suspend,
 	.resume = fl2000_resume,
+	.reset_resume = fl2000_reset_resume,
 #endif
 };
 
-module_usb_driver(fl2000_driver);
+static int __init fl2000_init(void)
+{
+	int ret;
+
+	fl2000_stream_wq =
+		alloc_workqueue("fl2000_stream", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!fl2000_stream_wq)
+		return -ENOMEM;
+
+	fl2000_event_wq = alloc_workqueue("fl2000_event", WQ_UNBOUND, 0);
+	if (!fl2000_event_wq) {
+		ret = -ENOMEM;
+		goto err_destroy_stream_wq;
+	}
+
+	ret = usb_register(&fl2000_driver);
+	if (ret)
+		goto err_destroy_event_wq;
+
+	return 0;
+
+err_destroy_event_wq:
+	destroy_workqueue(fl2000_event_wq);
+err_destroy_stream_wq:
+	destroy_workqueue(fl2000_stream_wq);
+	return ret;
+}
+
+static void __exit fl2000_exit(void)
+{
+	usb_deregister(&fl2000_driver);
+	destroy_workqueue(fl2000_event_wq);
+	destroy_workqueue(fl2000_stream_wq);
+}
+
+module_init(fl2000_init);
+module_exit(fl2000_exit);
 
 MODULE_AUTHOR("Artem Mygaiev");
 MODULE_DESCRIPTION("FL2000 USB display driver");
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per client usage in DRM fdinfo. Conversion of framebuffer to the stream format is done by CPU on
+ * behalf of the client that created the framebuffer, and its time is reported as the "convert"
+ * engine. Stream buffers are reported as memory of the client whose frame was converted last,
+ * along with GEM objects of every client. Framebuffer owners are recorded on creation, since the
+ * framebuffer itself does not keep its file.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include <drm/drm_file.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_print.h>
+
+#include "fl2000.h"
+
+int fl2000_fdinfo_open(struct drm_device *drm, struct drm_file *file)
+{
+	struct fl2000_file *priv;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	file->driver_priv = priv;
+
+	return 0;
+}
+
+/* Framebuffers of the file are gone from the planes by now, so no conversion is accounted to it */
+void fl2000_fdinfo_postclose(struct drm_device *drm, struct drm_file *file)
+{
+	struct fl2000 *fl2000_dev = drm->dev_private;
+	struct fl2000_file *priv = file->driver_priv;
+	struct fl2000_file *entry;
+	unsigned long id;
+
+	xa_for_each (&fl2000_dev->fb_owners, id, entry) {
+		if (entry == priv)
+			xa_erase(&fl2000_dev->fb_owners, id);
+	}
+	cmpxchg(&fl2000_dev->stream_owner, priv, NULL);
+
+	kfree(priv);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+struct drm_framebuffer *
+fl2000_fdinfo_fb_create(struct drm_device *drm, struct drm_file *file,
+			const struct drm_format_info *info,
+			const struct drm_mode_fb_cmd2 *mode_cmd)
+#else
+struct drm_framebuffer *
+fl2000_fdinfo_fb_create(struct drm_device *drm, struct drm_file *file,
+			const struct drm_mode_fb_cmd2 *mode_cmd)
+#endif
+{
+	struct fl2000 *fl2000_dev = drm->dev_private;
+	struct drm_framebuffer *fb;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	fb = drm_gem_fb_create_with_dirty(drm, file, info, mode_cmd);
+#else
+	fb = drm_gem_fb_create_with_dirty(drm, file, mode_cmd);
+#endif
+	if (IS_ERR(fb))
+		return fb;
+
+	/* Stale entry of a destroyed framebuffer with the same id is replaced. Failure only loses
+	 * accounting
+	 */
+	xa_store(&fl2000_dev->fb_owners, fb->base.id, file->driver_priv,
+		 GFP_KERNEL);
+
+	return fb;
+}
+
+/**
+ * fl2000_fdinfo_account() - account conversion to the framebuffer owner
+ * @fl2000_dev:	FL2000 device
+ * @fb:		converted framebuffer
+ * @ns:		conversion time
+ */
+void fl2000_fdinfo_account(struct fl2000 *fl2000_dev,
+			   struct drm_framebuffer *fb, u64 ns)
+{
+	struct fl2000_file *priv = xa_load(&fl2000_dev->fb_owners, fb->base.id);
+
+	WRITE_ONCE(fl2000_dev->stream_owner, priv);
+	if (priv)
+		WRITE_ONCE(priv->convert_ns, priv->convert_ns + ns);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+void fl2000_fdinfo_show(struct drm_printer *p, struct drm_file *file)
+{
+	struct fl2000 *fl2000_dev = file->minor->dev->dev_private;
+	struct fl2000_file *priv = file->driver_priv;
+
+	drm_printf(p, "drm-engine-convert:\t%llu ns\n",
+		   READ_ONCE(priv->convert_ns));
+
+	drm_show_memory_stats(p, file);
+
+	if (READ_ONCE(fl2000_dev->stream_owner) == priv)
+		drm_printf(p, "drm-memory-stream:\t%lu KiB\n",
+			   fl2000_stream_pages(fl2000_dev) << (PAGE_SHIFT - 10));
+}
+#endif
+
+void fl2000_fdinfo_init(struct fl2000 *fl2000_dev)
+{
+	xa_init(&fl2000_dev->fb_owners);
+}
+
+void fl2000_fdinfo_release(struct fl2000 *fl2000_dev)
+{
+	xa_destroy(&fl2000_dev->fb_owners);
+	fl2000_dev->stream_owner = NULL;
+}
@@ -4,33 +4,204 @@
  * (C) Copyright 2018-2020, Artem Mygaiev
  */
 
+#include <linux/module.h>
+
 #include <drm/drm_probe_helper.h>
 
 #include "fl2000.h"
+#include "fl2000_trace.h"
 
 #define INTR_BUFSIZE 1
 
+static bool intr_debug;
+module_param(intr_debug, bool, 0644);
+MODULE_PARM_DESC(intr_debug, "Log interrupt events, rate-limited (default: false)");
+
+#define fl2000_intr_dbg(__dev, __fmt, ...)                                     \
+	do {                                                                   \
+		if (intr_debug)                                                \
+			dev_info_ratelimited(__dev, __fmt, ##__VA_ARGS__);     \
+	} while (0)
+
+/* Account interrupt events, returns true if sink state has changed */
+static bool fl2000_intr_process(struct fl2000 *fl2000_dev,
+				union fl2000_vga_status_reg status, bool irq)
+{
+	struct fl2000_intr_stats *stats = &fl2000_dev->intr_stats;
+	struct device *dev = &fl2000_dev->usb_dev->dev;
+	bool sink_event = false;
+	unsigned long flags;
+
+	trace_fl2000_intr(fl2000_dev->usb_dev, status.val);
+
+	/* Status can be also polled, not only read on interrupt */
+	spin_lock_irqsave(&fl2000_dev->intr_lock, flags);
+
+	if (irq)
+		stats->interrupts++;
+
+	fl2000_vblank_sample(fl2000_dev, status.frame_cnt);
+
+	if (status.hdmi_event || status.monitor_event || status.edid_event) {
+		stats->sink_events++;
+		fl2000_intr_dbg(dev, "sink event, status %d", status.vga_status);
+		sink_event = true;
+	}
+
+	if (status.lbuf_overflow) {
+		stats->lbuf_overflow++;
+		fl2000_intr_dbg(dev, "lbuf_overflow");
+	}
+
+	if (status.lbuf_underflow) {
+		stats->lbuf_underflow++;
+		fl2000_intr_dbg(dev, "lbuf_underflow");
+	}
+
+	fl2000_lbuf_event(fl2000_dev, status.lbuf_underflow,
+			  status.lbuf_overflow);
+
+	/* Halt leaves output dead until line buffer is reset */
+	if (status.lbuf_halt) {
+		stats->lbuf_halt++;
+		fl2000_intr_dbg(dev, "lbuf_halt");
+		fl2000_lbuf_halt(fl2000_dev);
+	}
+
+	/* Single dropped frame is not worth a stream restart, output goes on with the next one */
+	if (status.vga_error) {
+		stats->vga_error++;
+		fl2000_intr_dbg(dev, "vga frame drop");
+	}
+
+	if (status.td_drop) {
+		stats->td_drop++;
+		fl2000_intr_dbg(dev, "td_drop");
+	}
+
+	spin_unlock_irqrestore(&fl2000_dev->intr_lock, flags);
+
+	return sink_event;
+}
+
+/**
+ * fl2000_intr_poll() - read and process interrupt status outside of interrupt
+ * @fl2000_dev:	FL2000 device
+ *
+ * Status register is cleared on read, so it shall never be read without processing. Shall be
+ * called from process context
+ *
+ * Return: Operation result
+ */
+int fl2000_intr_poll(struct fl2000 *fl2000_dev)
+{
+	union fl2000_vga_status_reg status;
+	int ret;
+
+	ret = fl2000_check_interrupt(fl2000_dev->usb_dev, &status);
+	if (ret)
+		return ret;
+
+	if (fl2000_intr_process(fl2000_dev, status, false))
+		queue_work(fl2000_event_wq, &fl2000_dev->intr_work);
+
+	return 0;
+}
+
 static void fl2000_intr_work(struct work_struct *work)
 {
-	int event;
 	struct fl2000 *fl2000_dev =
 		container_of(work, struct fl2000, intr_work);
 
-	event = fl2000_check_interrupt(fl2000_dev->usb_dev);
-	if (event) {
-		drm_kms_helper_hotplug_event(&fl2000_dev->drm);
-		//drm_helper_hpd_irq_event(fl2000_dev->drm);
-	}
+	drm_kms_helper_hotplug_event(&fl2000_dev->drm);
+	//drm_helper_hpd_irq_event(fl2000_dev->drm);
 }
 
 void fl2000_intr_release(struct fl2000 *fl2000_dev)
 {
-	usb_poison_urb(fl2000_dev->intr_urb);
+	fl2000_intr_stop(fl2000_dev);
 	cancel_work_sync(&fl2000_dev->intr_work);
-	destroy_workqueue(fl2000_dev->intr_work_queue);
 	usb_free_coherent(fl2000_dev->usb_dev, INTR_BUFSIZE,
 			  fl2000_dev->intr_buf, fl2000_dev->transfer_dma);
 	usb_free_urb(fl2000_dev->intr_urb);
+	usb_free_urb(fl2000_dev->status_urb);
+	kfree(fl2000_dev->status_req);
+	kfree(fl2000_dev->status_buf);
+}
+
+static void fl2000_intr_restart(struct fl2000 *fl2000_dev)
+{
+	int ret;
+	struct urb *urb = fl2000_dev->intr_urb;
+
+	/* For interrupt URBs, as part of successful URB submission urb->interval is modified to
+	 * reflect the actual transfer period used, so we need to restore it
+	 */
+	urb->interval = fl2000_dev->poll_interval;
+	urb->start_frame = -1;
+
+	/* Restart urb */
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret && ret != -EPERM) {
+		dev_err(&fl2000_dev->usb_dev->dev, "URB submission failed (%d)",
+			ret);
+		/* TODO: Signal fault to system and start shutdown of usb_dev */
+	}
+}
+
+static void fl2000_status_ack_completion(struct urb *urb)
+{
+	struct fl2000 *fl2000_dev = urb->context;
+
+	if (urb->status)
+		dev_err(&fl2000_dev->usb_dev->dev,
+			"Interrupt status acknowledge failed (%d)",
+			urb->status);
+
+	/* Status processing is over, can wait for the next interrupt */
+	fl2000_intr_restart(fl2000_dev);
+}
+
+static void fl2000_status_read_completion(struct urb *urb)
+{
+	int ret;
+	struct fl2000 *fl2000_dev = urb->context;
+	union fl2000_vga_status_reg status;
+	u32 mask;
+
+	if (urb->status || urb->actual_length != sizeof(u32)) {
+		dev_err(&fl2000_dev->usb_dev->dev,
+			"Interrupt status read failed (%d)", urb->status);
+		fl2000_intr_restart(fl2000_dev);
+		return;
+	}
+
+	status.val = *fl2000_dev->status_buf;
+
+	/* Sink detection involves reading I2C registers, etc. so better to schedule a work queue */
+	if (fl2000_intr_process(fl2000_dev, status, true))
+		queue_work(fl2000_event_wq, &fl2000_dev->intr_work);
+
+	/* Nothing to acknowledge, save a control transfer */
+	mask = fl2000_status_ack_mask(status);
+	if (!mask) {
+		fl2000_intr_restart(fl2000_dev);
+		return;
+	}
+
+	/* Only bits being acknowledged are written back */
+	*fl2000_dev->status_buf = status.val & mask;
+	fl2000_fill_reg_urb(fl2000_dev->usb_dev, urb, fl2000_dev->status_req,
+			    fl2000_dev->status_buf, false,
+			    FL2000_VGA_STATUS_REG,
+			    fl2000_status_ack_completion, fl2000_dev);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret) {
+		if (ret != -EPERM)
+			dev_err(&fl2000_dev->usb_dev->dev,
+				"Status URB submission failed (%d)", ret);
+		fl2000_intr_restart(fl2000_dev);
+	}
 }
 
 static void fl2000_intr_completion(struct urb *urb)
@@ -45,23 +216,41 @@ static void fl2000_intr_completion(struct urb *urb)
 		return;
 	}
 
-	/* This possibly involves reading I2C registers, etc. so better to schedule a work queue */
-	queue_work(fl2000_dev->intr_work_queue, &fl2000_dev->intr_work);
-
-	/* For interrupt URBs, as part of successful URB submission urb->interval is modified to
-	 * reflect the actual transfer period used, so we need to restore it
+	/* Read and acknowledge status with chained control URBs, interrupt URB is restarted at the
+	 * end of the chain so there is always a single status transaction in progress
 	 */
-	urb->interval = fl2000_dev->poll_interval;
-	urb->start_frame = -1;
-
-	/* Restart urb */
-	ret = fl2000_submit_urb(urb);
+	fl2000_fill_reg_urb(usb_dev, fl2000_dev->status_urb,
+			    fl2000_dev->status_req, fl2000_dev->status_buf,
+			    true, FL2000_VGA_STATUS_REG,
+			    fl2000_status_read_completion, fl2000_dev);
+	ret = usb_submit_urb(fl2000_dev->status_urb, GFP_ATOMIC);
 	if (ret) {
-		dev_err(&usb_dev->dev, "URB submission failed (%d)", ret);
-		/* TODO: Signal fault to system and start shutdown of usb_dev */
+		if (ret != -EPERM)
+			dev_err(&usb_dev->dev,
+				"Status URB submission failed (%d)", ret);
+		fl2000_intr_restart(fl2000_dev);
 	}
 }
 
+/* Stop interrupt processing, e.g. while device is being reset or suspended */
+void fl2000_intr_stop(struct fl2000 *fl2000_dev)
+{
+	/* Status URB completion may resubmit interrupt URB, so poison it first */
+	usb_poison_urb(fl2000_dev->intr_urb);
+	usb_poison_urb(fl2000_dev->status_urb);
+}
+
+int fl2000_intr_start(struct fl2000 *fl2000_dev)
+{
+	usb_unpoison_urb(fl2000_dev->status_urb);
+	usb_unpoison_urb(fl2000_dev->intr_urb);
+
+	fl2000_dev->intr_urb->interval = fl2000_dev->poll_interval;
+	fl2000_dev->intr_urb->start_frame = -1;
+
+	return usb_submit_urb(fl2000_dev->intr_urb, GFP_KERNEL);
+}
+
 /**
  * fl2000_intr_create() - interrupt processing context creation
  * @interface:	USB interrupt transfers interface
@@ -91,6 +280,7 @@ int fl2000_intr_create(struct fl2000 *fl2000_dev)
 
 	fl2000_dev->poll_interval = desc->bInterval;
 	INIT_WORK(&fl2000_dev->intr_work, &fl2000_intr_work);
+	spin_lock_init(&fl2000_dev->intr_lock);
 
 	fl2000_dev->intr_urb = usb_alloc_urb(0, GFP_ATOMIC);
 	if (!fl2000_dev->intr_urb) {
@@ -99,17 +289,28 @@ int fl2000_intr_create(struct fl2000 *fl2000_dev)
 		return -ENOMEM;
 	}
 
-	fl2000_dev->intr_buf = usb_alloc_coherent(
-		usb_dev, INTR_BUFSIZE, GFP_KERNEL, &fl2000_dev->transfer_dma);
-	if (!fl2000_dev->intr_buf) {
-		dev_err(&usb_dev->dev, "Cannot allocate interrupt data");
+	fl2000_dev->status_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!fl2000_dev->status_urb) {
+		dev_err(&usb_dev->dev, "Allocate status URB failed");
 		fl2000_intr_release(fl2000_dev);
 		return -ENOMEM;
 	}
 
-	fl2000_dev->intr_work_queue = create_workqueue("fl2000_interrupt");
-	if (!fl2000_dev->intr_work_queue) {
-		dev_err(&usb_dev->dev, "Create interrupt workqueue failed");
+	/* Control request and data shall be DMA-capable */
+	fl2000_dev->status_req = kzalloc(sizeof(*fl2000_dev->status_req),
+					 GFP_KERNEL);
+	fl2000_dev->status_buf = kzalloc(sizeof(*fl2000_dev->status_buf),
+					 GFP_KERNEL);
+	if (!fl2000_dev->status_req || !fl2000_dev->status_buf) {
+		dev_err(&usb_dev->dev, "Cannot allocate status data");
+		fl2000_intr_release(fl2000_dev);
+		return -ENOMEM;
+	}
+
+	fl2000_dev->intr_buf = usb_alloc_coherent(
+		usb_dev, INTR_BUFSIZE, GFP_KERNEL, &fl2000_dev->transfer_dma);
+	if (!fl2000_dev->intr_buf) {
+		dev_err(&usb_dev->dev, "Cannot allocate interrupt data");
 		fl2000_intr_release(fl2000_dev);
 		return -ENOMEM;
 	}
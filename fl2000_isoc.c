@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Isochronous stream transport. Periodic bandwidth is reserved by the host controller when
+ * isochronous altsetting is selected, so stream does not compete with bulk traffic of other
+ * devices. Isochronous URBs cannot use scatter-gather lists, so frame data is copied to coherent
+ * buffers of a small URB pool chunk by chunk. End of frame is marked with a short or zero-length
+ * packet, same as with bulk transfers.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/bitops.h>
+#include <linux/usb.h>
+
+#include "fl2000.h"
+
+/* Microframes per second */
+#define FL2000_ISOC_MFRAMES 8000
+
+/* Bytes transferred per service interval */
+static unsigned int fl2000_isoc_bpi(struct usb_device *usb_dev,
+				    struct usb_host_endpoint *ep)
+{
+	if (usb_dev->speed >= USB_SPEED_SUPER)
+		return le16_to_cpu(ep->ss_ep_comp.wBytesPerInterval);
+
+	return usb_endpoint_maxp(&ep->desc) * usb_endpoint_maxp_mult(&ep->desc);
+}
+
+/* Isochronous OUT endpoint of the altsetting, if any */
+static struct usb_host_endpoint *
+fl2000_isoc_ep(struct usb_host_interface *alt)
+{
+	unsigned int i;
+
+	for (i = 0; i < alt->desc.bNumEndpoints; i++) {
+		struct usb_host_endpoint *ep = &alt->endpoint[i];
+
+		if (usb_endpoint_is_isoc_out(&ep->desc))
+			return ep;
+	}
+
+	return NULL;
+}
+
+static void fl2000_isoc_free_urbs(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	unsigned int i;
+
+	for (i = 0; i < FL2000_ISOC_URBS; i++) {
+		struct urb *urb = isoc->urbs[i].urb;
+
+		if (!urb)
+			continue;
+
+		usb_free_coherent(fl2000_dev->usb_dev, isoc->buf_size,
+				  urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		isoc->urbs[i].urb = NULL;
+	}
+}
+
+static int fl2000_isoc_alloc_urbs(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	unsigned int i;
+
+	isoc->buf_size = isoc->packet_size * FL2000_ISOC_PACKETS;
+
+	for (i = 0; i < FL2000_ISOC_URBS; i++) {
+		struct urb *urb;
+
+		/* One extra packet for zero-length end of frame */
+		urb = usb_alloc_urb(FL2000_ISOC_PACKETS + 1, GFP_KERNEL);
+		if (!urb)
+			goto error;
+
+		urb->transfer_buffer = usb_alloc_coherent(fl2000_dev->usb_dev,
+							  isoc->buf_size,
+							  GFP_KERNEL,
+							  &urb->transfer_dma);
+		if (!urb->transfer_buffer) {
+			usb_free_urb(urb);
+			goto error;
+		}
+
+		isoc->urbs[i].fl2000_dev = fl2000_dev;
+		isoc->urbs[i].urb = urb;
+		isoc->urbs[i].index = i;
+	}
+
+	return 0;
+
+error:
+	fl2000_isoc_free_urbs(fl2000_dev);
+	return -ENOMEM;
+}
+
+/**
+ * fl2000_isoc_setup() - select isochronous altsetting and allocate URB pool
+ * @fl2000_dev:	FL2000 device
+ *
+ * Altsettings are tried from the largest bandwidth down, host controller refuses those that do
+ * not fit into the periodic schedule
+ *
+ * Return: Operation result
+ */
+int fl2000_isoc_setup(struct fl2000 *fl2000_dev)
+{
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	struct usb_interface *intf = fl2000_dev->intf[FL2000_USBIF_AVCONTROL];
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	unsigned long tried = 0;
+	int ret = -ENODEV;
+
+	for (;;) {
+		struct usb_host_interface *best = NULL;
+		struct usb_host_endpoint *best_ep = NULL;
+		u64 best_bw = 0;
+		unsigned int i;
+
+		for (i = 0; i < intf->num_altsetting; i++) {
+			struct usb_host_interface *alt = &intf->altsetting[i];
+			struct usb_host_endpoint *ep = fl2000_isoc_ep(alt);
+			u64 bw;
+
+			if (!ep || test_bit(i, &tried))
+				continue;
+
+			bw = (u64)fl2000_isoc_bpi(usb_dev, ep) *
+			     FL2000_ISOC_MFRAMES >>
+			     (ep->desc.bInterval - 1);
+			if (bw > best_bw) {
+				best = alt;
+				best_ep = ep;
+				best_bw = bw;
+			}
+		}
+
+		if (!best)
+			break;
+		set_bit(best - intf->altsetting, &tried);
+
+		ret = usb_set_interface(usb_dev, FL2000_USBIF_AVCONTROL,
+					best->desc.bAlternateSetting);
+		if (ret)
+			continue;
+
+		isoc->altsetting = best->desc.bAlternateSetting;
+		isoc->pipe = usb_sndisocpipe(usb_dev,
+					     usb_endpoint_num(&best_ep->desc));
+		isoc->interval = 1 << (best_ep->desc.bInterval - 1);
+		isoc->packet_size = fl2000_isoc_bpi(usb_dev, best_ep);
+		isoc->bandwidth = best_bw;
+
+		ret = fl2000_isoc_alloc_urbs(fl2000_dev);
+		if (ret)
+			return ret;
+
+		dev_dbg(&usb_dev->dev,
+			"Isochronous altsetting %u, %u bytes per %u microframe(s)",
+			isoc->altsetting, isoc->packet_size, isoc->interval);
+
+		return 0;
+	}
+
+	dev_err(&usb_dev->dev, "No usable isochronous altsetting (%d)", ret);
+
+	return ret;
+}
+
+/* Shall be called with no isochronous URBs in flight */
+void fl2000_isoc_release(struct fl2000 *fl2000_dev)
+{
+	fl2000_isoc_free_urbs(fl2000_dev);
+	fl2000_dev->isoc.bandwidth = 0;
+}
+
+/**
+ * fl2000_isoc_submit() - copy chunk of a frame to pool URB and submit it
+ * @fl2000_dev:	FL2000 device
+ * @iurb:	idle pool URB
+ * @data:	frame data
+ * @len:	data length, shall not exceed buffer size
+ * @frame_end:	data is the last chunk of the frame
+ * @complete:	completion callback
+ *
+ * Return: Operation result
+ */
+int fl2000_isoc_submit(struct fl2000 *fl2000_dev, struct fl2000_isoc_urb *iurb,
+		       const void *data, size_t len, bool frame_end,
+		       usb_complete_t complete)
+{
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	struct urb *urb = iurb->urb;
+	unsigned int i, offset = 0;
+
+	memcpy(urb->transfer_buffer, data, len);
+
+	for (i = 0; offset < len; i++) {
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length =
+			min_t(size_t, isoc->packet_size, len - offset);
+		offset += urb->iso_frame_desc[i].length;
+	}
+
+	/* HW expects a short packet at the end of frame */
+	if (frame_end && !(len % isoc->packet_size)) {
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = 0;
+		i++;
+	}
+
+	urb->dev = fl2000_dev->usb_dev;
+	urb->pipe = isoc->pipe;
+	urb->interval = isoc->interval;
+	urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+	urb->transfer_buffer_length = len;
+	urb->number_of_packets = i;
+	urb->complete = complete;
+	urb->context = iurb;
+	iurb->frame_end = frame_end;
+
+	usb_anchor_urb(urb, &fl2000_dev->anchor);
+
+	return fl2000_submit_urb(urb);
+}
@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Line buffer watermarks are computed for every mode and then tuned at runtime from the line
+ * buffer underflow/overflow interrupts: underflow raises low watermark and then stream queue
+ * depth, overflow does the opposite. Each event first undoes the offset made by the opposite one,
+ * so only one watermark is moved at a time and low watermark stays below high one. Learned offsets
+ * survive modesets, so configuration converges for the host controller the device is attached to.
+ *
+ * When underflow persists with all of that already at maximum, output depth is lowered one byte
+ * per pixel at a time, which reduces stream bandwidth. Original depth of the mode is restored
+ * step by step once the link has been quiet for long enough.
+ *
+ * Line buffer halt is recovered by pulsing line buffer reset with stream paused, DRM state is not
+ * touched. Since every stream buffer is a complete frame, restarted stream is synchronized at frame
+ * boundary. VGA errors are isolated frame drops and are only counted.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include "fl2000.h"
+
+/* Watermark units are not documented. Assume 64-bit words since stream data is always fed to the
+ * line buffer in multiples of 8 bytes
+ */
+#define FL2000_LBUF_UNIT 8
+
+/* Default watermarks, in lines */
+#define FL2000_LBUF_LO_LINES 2
+#define FL2000_LBUF_HI_LINES 8
+
+/* Maximum runtime correction of each watermark, in lines. Only one of them is corrected at a time,
+ * so watermarks cannot cross
+ */
+#define FL2000_LBUF_TUNE_LINES_MAX 4
+
+/* Events that happen right after adjustment reflect previous configuration, ignore them */
+#define FL2000_LBUF_TUNE_INTERVAL_MS 250
+
+/* Configuration is considered stable if no events were seen within this period */
+#define FL2000_LBUF_SETTLE_MS 10000
+
+/* Underflow events with nothing left to tune that trigger output depth fallback */
+#define FL2000_LBUF_DROP_EVENTS 4
+
+/* Quiet period before output depth is stepped back up, ms. Longer than settle period so that
+ * depth does not oscillate on a marginal link
+ */
+#define FL2000_LBUF_RESTORE_MS (3 * FL2000_LBUF_SETTLE_MS)
+
+/* Register fields width */
+#define FL2000_LBUF_MARK_MAX ((1u << 17) - 1)
+#define FL2000_LBUF_ASSERT_RDY_MAX ((1u << 15) - 1)
+
+enum fl2000_lbuf_event {
+	FL2000_LBUF_UNDERFLOW,
+	FL2000_LBUF_OVERFLOW,
+};
+
+/* Shall be called with lbuf lock held */
+static void fl2000_lbuf_apply(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+	u32 lo_lines = FL2000_LBUF_LO_LINES + lbuf->lo_extra;
+	u32 hi_lines = FL2000_LBUF_HI_LINES - lbuf->hi_less;
+
+	/* Nothing to program before the first modeset */
+	if (!lbuf->line_len)
+		return;
+
+	/* Crossed watermarks are never programmed into the hardware */
+	lo_lines = min(lo_lines, hi_lines - 1);
+
+	lbuf->lo_mark = min(lbuf->line_len * lo_lines, FL2000_LBUF_MARK_MAX);
+	lbuf->hi_mark = min(lbuf->line_len * hi_lines, FL2000_LBUF_MARK_MAX);
+	lbuf->assert_rdy = min((lbuf->lo_mark + lbuf->hi_mark) / 2,
+			       FL2000_LBUF_ASSERT_RDY_MAX);
+
+	fl2000_set_watermarks(fl2000_dev->usb_dev, lbuf->lo_mark,
+			      lbuf->hi_mark, lbuf->assert_rdy);
+}
+
+/* Shall be called with lbuf lock held */
+static int fl2000_lbuf_set_depth(struct fl2000 *fl2000_dev, u32 bytes_pix)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+	u64 bw = (u64)fl2000_dev->pixclock * bytes_pix;
+	u32 old_bytes_pix = fl2000_dev->bytes_pix;
+	int ret;
+
+	/* Stepping up shall fit into what is left by other devices on the link */
+	if (bytes_pix > old_bytes_pix) {
+		if (fl2000_bw_bytes_pix(fl2000_dev, fl2000_dev->pixclock,
+					true) < bytes_pix)
+			return -ENOSPC;
+		ret = fl2000_bw_reserve(fl2000_dev, bw);
+		if (ret)
+			return ret;
+	}
+
+	ret = fl2000_stream_set_format(fl2000_dev, bytes_pix);
+	if (ret) {
+		if (bytes_pix > old_bytes_pix)
+			fl2000_bw_reserve(fl2000_dev,
+					  (u64)fl2000_dev->pixclock *
+						  old_bytes_pix);
+		return ret;
+	}
+
+	if (bytes_pix < old_bytes_pix)
+		fl2000_bw_reserve(fl2000_dev, bw);
+
+	lbuf->line_len = DIV_ROUND_UP(lbuf->hactive * bytes_pix,
+				      FL2000_LBUF_UNIT);
+	fl2000_lbuf_apply(fl2000_dev);
+
+	dev_info(&fl2000_dev->usb_dev->dev, "Output depth %u -> %u bytes/pixel",
+		 old_bytes_pix, bytes_pix);
+
+	return 0;
+}
+
+/* Shall be called with lbuf lock held */
+static void fl2000_lbuf_drop_depth(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	if (++lbuf->saturated < FL2000_LBUF_DROP_EVENTS)
+		return;
+	lbuf->saturated = 0;
+
+	if (fl2000_dev->bytes_pix <= 1 ||
+	    fl2000_lbuf_set_depth(fl2000_dev, fl2000_dev->bytes_pix - 1))
+		return;
+
+	lbuf->depth_drops++;
+	mod_delayed_work(fl2000_event_wq, &lbuf->restore_work,
+			 msecs_to_jiffies(FL2000_LBUF_RESTORE_MS));
+}
+
+static void fl2000_lbuf_restore_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, lbuf.restore_work.work);
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+	unsigned long quiet = msecs_to_jiffies(FL2000_LBUF_RESTORE_MS);
+
+	mutex_lock(&lbuf->lock);
+
+	if (!fl2000_dev->active ||
+	    fl2000_dev->bytes_pix >= lbuf->mode_bytes_pix)
+		goto unlock;
+
+	/* Events seen recently, keep waiting */
+	if (time_before(jiffies, lbuf->last_event + quiet)) {
+		queue_delayed_work(fl2000_event_wq, &lbuf->restore_work,
+				   lbuf->last_event + quiet - jiffies);
+		goto unlock;
+	}
+
+	/* Bandwidth can still be taken by other devices, try again later */
+	if (fl2000_lbuf_set_depth(fl2000_dev, fl2000_dev->bytes_pix + 1)) {
+		queue_delayed_work(fl2000_event_wq, &lbuf->restore_work, quiet);
+		goto unlock;
+	}
+
+	lbuf->depth_restores++;
+	lbuf->last_event = jiffies;
+
+	if (fl2000_dev->bytes_pix < lbuf->mode_bytes_pix)
+		queue_delayed_work(fl2000_event_wq, &lbuf->restore_work, quiet);
+
+unlock:
+	mutex_unlock(&lbuf->lock);
+}
+
+static void fl2000_lbuf_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, lbuf.work);
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+	unsigned int depth = fl2000_dev->queue_depth;
+	bool underflow, overflow;
+
+	underflow = test_and_clear_bit(FL2000_LBUF_UNDERFLOW, &lbuf->events);
+	overflow = test_and_clear_bit(FL2000_LBUF_OVERFLOW, &lbuf->events);
+
+	mutex_lock(&lbuf->lock);
+
+	lbuf->last_event = jiffies;
+	if (time_before(jiffies, lbuf->last_adjust + msecs_to_jiffies(
+					 FL2000_LBUF_TUNE_INTERVAL_MS)))
+		goto unlock;
+
+	/* Both at once mean that there is nothing to tune, watermarks are fine */
+	if (underflow && overflow)
+		goto unlock;
+
+	if (underflow) {
+		/* Undo lowered high watermark, request data earlier, then keep more frames in flight */
+		if (lbuf->hi_less)
+			lbuf->hi_less--;
+		else if (lbuf->lo_extra < FL2000_LBUF_TUNE_LINES_MAX)
+			lbuf->lo_extra++;
+		else if (depth < FL2000_QUEUE_DEPTH_MAX)
+			depth++;
+		else
+			fl2000_lbuf_drop_depth(fl2000_dev);
+	} else if (overflow) {
+		/* Undo raised low watermark, keep less frames in flight, then lower high watermark */
+		if (lbuf->lo_extra)
+			lbuf->lo_extra--;
+		else if (depth > FL2000_QUEUE_DEPTH_MIN)
+			depth--;
+		else if (lbuf->hi_less < FL2000_LBUF_TUNE_LINES_MAX)
+			lbuf->hi_less++;
+	}
+
+	if (depth != fl2000_dev->queue_depth)
+		fl2000_stream_set_depth(fl2000_dev, depth);
+
+	fl2000_lbuf_apply(fl2000_dev);
+
+	lbuf->last_adjust = jiffies;
+	lbuf->adjustments++;
+
+unlock:
+	mutex_unlock(&lbuf->lock);
+}
+
+/**
+ * fl2000_lbuf_event() - report line buffer interrupt events
+ * @fl2000_dev:	FL2000 device
+ * @underflow:	line buffer underflow was reported
+ * @overflow:	line buffer overflow was reported
+ *
+ * Can be called from atomic context, adjustments are done from the work
+ */
+void fl2000_lbuf_event(struct fl2000 *fl2000_dev, bool underflow,
+		       bool overflow)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	if (underflow) {
+		set_bit(FL2000_LBUF_UNDERFLOW, &lbuf->events);
+		fl2000_pacing_underflow(fl2000_dev);
+	}
+	if (overflow)
+		set_bit(FL2000_LBUF_OVERFLOW, &lbuf->events);
+
+	if (underflow || overflow)
+		queue_work(fl2000_event_wq, &lbuf->work);
+}
+
+static void fl2000_lbuf_recover_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, lbuf.recover_work);
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+	s64 elapsed;
+	int ret;
+
+	fl2000_stream_pause(fl2000_dev);
+	ret = fl2000_lbuf_reset(fl2000_dev->usb_dev);
+	fl2000_stream_resume(fl2000_dev);
+
+	if (ret) {
+		dev_err(&fl2000_dev->usb_dev->dev,
+			"Line buffer reset failed (%d)", ret);
+		lbuf->recover_failures++;
+		return;
+	}
+
+	elapsed = ktime_us_delta(ktime_get(), lbuf->recover_start);
+	lbuf->recoveries++;
+	lbuf->recover_last_us = elapsed;
+	lbuf->recover_max_us = max(lbuf->recover_max_us, elapsed);
+	lbuf->recover_total_us += elapsed;
+}
+
+/**
+ * fl2000_lbuf_halt() - report line buffer halt
+ * @fl2000_dev:	FL2000 device
+ *
+ * Can be called from atomic context, recovery is done from the work. Events that arrive while
+ * recovery is pending are merged into it
+ */
+void fl2000_lbuf_halt(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	if (work_pending(&lbuf->recover_work))
+		return;
+
+	lbuf->recover_start = ktime_get();
+	queue_work(fl2000_event_wq, &lbuf->recover_work);
+}
+
+bool fl2000_lbuf_settled(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	return time_after(jiffies, READ_ONCE(lbuf->last_event) +
+				    msecs_to_jiffies(FL2000_LBUF_SETTLE_MS));
+}
+
+void fl2000_lbuf_mode_set(struct fl2000 *fl2000_dev, u32 hactive,
+			  u32 bytes_pix)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	/* Depth of the new mode is restored by modeset itself */
+	cancel_delayed_work(&lbuf->restore_work);
+
+	mutex_lock(&lbuf->lock);
+	lbuf->hactive = hactive;
+	lbuf->mode_bytes_pix = bytes_pix;
+	lbuf->saturated = 0;
+	lbuf->line_len = DIV_ROUND_UP(hactive * bytes_pix, FL2000_LBUF_UNIT);
+	lbuf->last_event = jiffies;
+	fl2000_lbuf_apply(fl2000_dev);
+	mutex_unlock(&lbuf->lock);
+}
+
+/* Re-apply tuned watermarks after device has lost its state */
+void fl2000_lbuf_restore(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	mutex_lock(&lbuf->lock);
+	fl2000_lbuf_apply(fl2000_dev);
+	mutex_unlock(&lbuf->lock);
+}
+
+void fl2000_lbuf_init(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_lbuf *lbuf = &fl2000_dev->lbuf;
+
+	mutex_init(&lbuf->lock);
+	INIT_WORK(&lbuf->work, &fl2000_lbuf_work);
+	INIT_WORK(&lbuf->recover_work, &fl2000_lbuf_recover_work);
+	INIT_DELAYED_WORK(&lbuf->restore_work, &fl2000_lbuf_restore_work);
+	lbuf->last_event = jiffies;
+	lbuf->last_adjust = jiffies;
+}
+
+void fl2000_lbuf_release(struct fl2000 *fl2000_dev)
+{
+	cancel_work_sync(&fl2000_dev->lbuf.work);
+	cancel_work_sync(&fl2000_dev->lbuf.recover_work);
+	cancel_delayed_work_sync(&fl2000_dev->lbuf.restore_work);
+}
@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Just-in-time frame submission. FL2000 has no frame buffer: a frame URB completes only when the
+ * device has taken its last line, so every queued frame adds one frame period of latency. With
+ * pacing, the next frame is submitted only shortly before the frame in flight is expected to be
+ * consumed, and the newest converted frame is taken at that moment. Consumption is modelled with
+ * the frame period of the vblank timer, which follows hardware frame counter. Lead time grows when
+ * stream runs dry or line buffer underflows, and decays slowly otherwise.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#include "fl2000.h"
+
+static bool pacing;
+module_param(pacing, bool, 0644);
+MODULE_PARM_DESC(pacing, "Submit frames just in time instead of keeping the queue full (default: false)");
+
+/* Lead time bounds, us */
+#define FL2000_PACING_LEAD_MIN_US 2000
+#define FL2000_PACING_LEAD_INIT_US 4000
+
+/* Lead time increment on starvation and decay per frame, fractions of the frame period */
+#define FL2000_PACING_LEAD_STEP_DIV 8
+#define FL2000_PACING_LEAD_DECAY_DIV 256
+
+static s64 fl2000_pacing_period(struct fl2000 *fl2000_dev)
+{
+	return ktime_to_ns(READ_ONCE(fl2000_dev->vblank.period));
+}
+
+/**
+ * fl2000_pacing_active() - check if stream submissions are paced
+ * @fl2000_dev:	FL2000 device
+ *
+ * Only whole frame submissions of bulk transport are paced, and only if frame period is known
+ *
+ * Return: True if pacing is in effect
+ */
+bool fl2000_pacing_active(struct fl2000 *fl2000_dev)
+{
+	return READ_ONCE(pacing) &&
+	       fl2000_dev->transport == FL2000_TRANSPORT_BULK &&
+	       fl2000_pacing_period(fl2000_dev);
+}
+
+static enum hrtimer_restart fl2000_pacing_timer(struct hrtimer *timer)
+{
+	struct fl2000_pacing *pace =
+		container_of(timer, struct fl2000_pacing, timer);
+	struct fl2000 *fl2000_dev = container_of(pace, struct fl2000, pacing);
+
+	queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * fl2000_pacing_hold() - check if the next submission shall wait
+ * @fl2000_dev:	FL2000 device
+ *
+ * Stream work is requeued by timer when it is time to submit
+ *
+ * Return: True if submission shall be deferred
+ */
+bool fl2000_pacing_hold(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+	ktime_t deadline;
+	unsigned long flags;
+
+	if (!fl2000_pacing_active(fl2000_dev))
+		return false;
+
+	/* Nothing is being consumed, stream has to catch up */
+	if (!atomic_read(&fl2000_dev->urbs_in_flight))
+		return false;
+
+	spin_lock_irqsave(&pace->lock, flags);
+	deadline = ktime_sub_ns(pace->expected_end, pace->lead_ns);
+	spin_unlock_irqrestore(&pace->lock, flags);
+
+	if (ktime_compare(ktime_get(), deadline) >= 0)
+		return false;
+
+	pace->holds++;
+	hrtimer_start(&pace->timer, deadline, HRTIMER_MODE_ABS);
+
+	return true;
+}
+
+/* Account submitted frame, which starts to be consumed once previous one is over */
+void fl2000_pacing_submitted(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+	s64 period = fl2000_pacing_period(fl2000_dev);
+	ktime_t now = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&pace->lock, flags);
+	if (ktime_before(pace->expected_end, now))
+		pace->expected_end = now;
+	pace->expected_end = ktime_add_ns(pace->expected_end, period);
+	spin_unlock_irqrestore(&pace->lock, flags);
+}
+
+static void fl2000_pacing_grow(struct fl2000_pacing *pace, s64 period)
+{
+	pace->lead_ns = min(pace->lead_ns +
+				    div_s64(period, FL2000_PACING_LEAD_STEP_DIV),
+			    period * (FL2000_QUEUE_DEPTH_MAX - 1));
+}
+
+/**
+ * fl2000_pacing_completed() - account completed frame
+ * @fl2000_dev:	FL2000 device
+ *
+ * Can be called from atomic context, after in flight counter is updated
+ */
+void fl2000_pacing_completed(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+	s64 period = fl2000_pacing_period(fl2000_dev);
+	unsigned long flags;
+
+	if (!fl2000_pacing_active(fl2000_dev))
+		return;
+
+	spin_lock_irqsave(&pace->lock, flags);
+	if (!atomic_read(&fl2000_dev->urbs_in_flight) &&
+	    READ_ONCE(fl2000_dev->enabled)) {
+		/* Next frame was submitted too late */
+		pace->starved++;
+		fl2000_pacing_grow(pace, period);
+	} else {
+		pace->lead_ns = max_t(s64, pace->lead_ns -
+					      div_s64(period,
+						      FL2000_PACING_LEAD_DECAY_DIV),
+				      FL2000_PACING_LEAD_MIN_US * NSEC_PER_USEC);
+	}
+	spin_unlock_irqrestore(&pace->lock, flags);
+}
+
+/**
+ * fl2000_pacing_underflow() - account line buffer underflow
+ * @fl2000_dev:	FL2000 device
+ *
+ * Can be called from atomic context
+ */
+void fl2000_pacing_underflow(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+	unsigned long flags;
+
+	if (!fl2000_pacing_active(fl2000_dev))
+		return;
+
+	spin_lock_irqsave(&pace->lock, flags);
+	fl2000_pacing_grow(pace, fl2000_pacing_period(fl2000_dev));
+	spin_unlock_irqrestore(&pace->lock, flags);
+}
+
+/* Shall be called on stream start */
+void fl2000_pacing_start(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pace->lock, flags);
+	pace->expected_end = ktime_get();
+	spin_unlock_irqrestore(&pace->lock, flags);
+}
+
+/* Shall be called on stream stop, before stream work is cancelled */
+void fl2000_pacing_stop(struct fl2000 *fl2000_dev)
+{
+	hrtimer_cancel(&fl2000_dev->pacing.timer);
+}
+
+void fl2000_pacing_init(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_pacing *pace = &fl2000_dev->pacing;
+
+	spin_lock_init(&pace->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&pace->timer, fl2000_pacing_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&pace->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pace->timer.function = fl2000_pacing_timer;
+#endif
+	pace->lead_ns = FL2000_PACING_LEAD_INIT_US * NSEC_PER_USEC;
+}
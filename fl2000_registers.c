@@ -188,6 +188,26 @@ int fl2000_set_pixfmt(struct usb_device *usb_dev, u32 bytes_pix)
 	return 0;
 }
 
+int fl2000_set_watermarks(struct usb_device *usb_dev, u32 lo_mark, u32 hi_mark,
+			  u32 assert_rdy)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	union fl2000_vga_lbuf_reg lbuf = { .val = 0 };
+	union fl2000_vga_hi_mark hi = { .val = 0 };
+	union fl2000_vga_lo_mark lo = { .val = 0 };
+
+	lo.lbuf_low_watermark = lo_mark;
+	regmap_write(regmap, FL2000_VGA_LO_MARK, lo.val);
+
+	hi.lbuf_high_watermark = hi_mark;
+	regmap_write(regmap, FL2000_VGA_HI_MARK, hi.val);
+
+	lbuf.lbuf_watermark_assert_rdy = assert_rdy;
+	regmap_write(regmap, FL2000_VGA_LBUF_REG, lbuf.val);
+
+	return 0;
+}
+
 int fl2000_set_transfers(struct usb_device *usb_dev)
 {
 	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
@@ -215,6 +235,21 @@ int fl2000_set_transfers(struct usb_device *usb_dev)
 	return 0;
 }
 
+/* Isochronous frames are terminated with a zero-length packet, same as bulk ones */
+int fl2000_set_isoc(struct usb_device *usb_dev, bool enable)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	union fl2000_vga_isoch_reg isoch = { .val = 0 };
+	u32 mask = 0;
+
+	isoch.use_zero_len_frame = enable;
+	fl2000_add_bitmask(mask, union fl2000_vga_isoch_reg,
+			   use_zero_len_frame);
+
+	return regmap_write_bits(regmap, FL2000_VGA_ISOCH_REG, mask,
+				 isoch.val);
+}
+
 int fl2000_reset(struct usb_device *usb_dev)
 {
 	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
@@ -230,6 +265,59 @@ int fl2000_reset(struct usb_device *usb_dev)
 	return 0;
 }
 
+int fl2000_lbuf_reset(struct usb_device *usb_dev)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	union fl2000_vga_ctrl_reg_aclk aclk = { .val = 0 };
+	u32 mask = 0;
+	int ret;
+
+	fl2000_add_bitmask(mask, union fl2000_vga_ctrl_reg_aclk, lbuf_sw_rst);
+
+	aclk.lbuf_sw_rst = true;
+	ret = regmap_write_bits(regmap, FL2000_VGA_CTRL_REG_ACLK, mask,
+				aclk.val);
+	if (ret)
+		return ret;
+
+	aclk.lbuf_sw_rst = false;
+	return regmap_write_bits(regmap, FL2000_VGA_CTRL_REG_ACLK, mask,
+				 aclk.val);
+}
+
+/**
+ * fl2000_restore() - replay cached registers after device has lost its state
+ * @usb_dev:	USB device
+ *
+ * PLL settings are confirmed with reset before anything else is written, as on modeset. Volatile
+ * registers are not cached and shall be restored by the caller
+ *
+ * Return: Operation result
+ */
+int fl2000_restore(struct usb_device *usb_dev)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	int ret;
+
+	regcache_cache_only(regmap, false);
+
+	regcache_mark_dirty(regmap);
+	ret = regcache_sync_region(regmap, FL2000_VGA_PLL_REG,
+				   FL2000_VGA_PLL_REG);
+	if (ret)
+		return ret;
+
+	fl2000_reset(usb_dev);
+
+	/* SW reset does not clear all registers, so write everything back */
+	regcache_mark_dirty(regmap);
+	ret = regcache_sync(regmap);
+	if (ret)
+		return ret;
+
+	return fl2000_usb_magic(usb_dev);
+}
+
 int fl2000_afe_magic(struct usb_device *usb_dev)
 {
 	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
@@ -314,49 +402,60 @@ int fl2000_enable_interrupts(struct usb_device *usb_dev)
 	return 0;
 }
 
-int fl2000_check_interrupt(struct usb_device *usb_dev)
+/* Status bits that are not self-cleared on read and have to be written back */
+u32 fl2000_status_ack_mask(union fl2000_vga_status_reg status)
 {
-	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
-	union fl2000_vga_status_reg status;
-	int ret;
-	int sink_event = 0;
 	u32 mask = 0;
 
-	/* Process interrupt */
-	ret = regmap_read(regmap, FL2000_VGA_STATUS_REG, &status.val);
-	if (ret)
-		return 0; /* XXX: Cannot report error here */
-
-	if (status.hdmi_event || status.monitor_event || status.edid_event) {
-		dev_info(&usb_dev->dev, "is sink event %d", status.vga_status);
-		sink_event = 1;
-	}
-
 	/* LBUF issues are recoverable */
-	if (status.lbuf_overflow) {
+	if (status.lbuf_overflow)
 		fl2000_add_bitmask(mask, union fl2000_vga_status_reg,
 				   lbuf_overflow);
-		dev_info(&usb_dev->dev, "lbuf_overflow");
-	}
-	if (status.lbuf_underflow) {
+	if (status.lbuf_underflow)
 		fl2000_add_bitmask(mask, union fl2000_vga_status_reg,
 				   lbuf_underflow);
-		dev_info(&usb_dev->dev, "lbuf_underflow");
-	}
-	regmap_write_bits(regmap, FL2000_VGA_STATUS_REG, mask, status.val);
 
-	if (status.lbuf_halt) {
-		/* TODO: Reset LBUF using regmap_field for lbuf_sw_rst */
-		dev_info(&usb_dev->dev, "lbuf_halt");
-	}
+	return mask;
+}
 
-	if (status.vga_error) {
-		/* TODO: Don't know how to recover here */
-		dev_info(&usb_dev->dev, "vga frame drop");
-	}
-	dev_info(&usb_dev->dev, "interrupt");
+int fl2000_check_interrupt(struct usb_device *usb_dev,
+			   union fl2000_vga_status_reg *status)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	int ret;
+	u32 mask;
 
-	return sink_event;
+	/* Process interrupt */
+	ret = regmap_read(regmap, FL2000_VGA_STATUS_REG, &status->val);
+	if (ret)
+		return ret;
+
+	mask = fl2000_status_ack_mask(*status);
+	if (!mask)
+		return 0;
+
+	/* Status is cleared on read, write back acknowledged bits without reading it again */
+	return regmap_write(regmap, FL2000_VGA_STATUS_REG, status->val & mask);
+}
+
+/* Register access from atomic context: only fills control URB, submission is up to the caller.
+ * Request and data shall be DMA-capable and stay valid until URB completion
+ */
+void fl2000_fill_reg_urb(struct usb_device *usb_dev, struct urb *urb,
+			 struct usb_ctrlrequest *req, u32 *data, bool read,
+			 u32 reg, usb_complete_t complete, void *context)
+{
+	req->bRequestType = USB_TYPE_VENDOR | (read ? USB_DIR_IN : USB_DIR_OUT);
+	req->bRequest = read ? CONTROL_MSG_READ : CONTROL_MSG_WRITE;
+	req->wValue = 0;
+	req->wIndex = cpu_to_le16((u16)reg);
+	req->wLength = cpu_to_le16(sizeof(u32));
+
+	usb_fill_control_urb(urb, usb_dev,
+			     read ? usb_rcvctrlpipe(usb_dev, 0) :
+				    usb_sndctrlpipe(usb_dev, 0),
+			     (unsigned char *)req, data, sizeof(u32), complete,
+			     context);
 }
 
 int fl2000_i2c_dword(struct usb_device *usb_dev, bool read, u16 addr, u8 offset,
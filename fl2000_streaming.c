@@ -3,128 +3,201 @@
  * Original driver uses default altsetting (#0) of streaming interface, which allows bursts of bulk
  * transfers of 15x1024 bytes on output. But the HW actually works incorrectly here: it uses same
  * endpoint #1 across interfaces 1 and 2, which is not allowed by USB specification: endpoint
- * addresses can be shared only between alternate settings, not interfaces. In order to workaround
- * this we use isochronous transfers instead of bulk. There is a possibility that we still can use
- * bulk transfers with interface 0, but this is yet to be checked.
+ * addresses can be shared only between alternate settings, not interfaces. Bulk altsetting of
+ * interface 0 is chosen by the largest burst its endpoint allows, and can be forced with module
+ * parameter. Sustained throughput is accounted per altsetting to compare them.
  *
  * (C) Copyright 2017, Fresco Logic, Incorporated.
  * (C) Copyright 2018-2020, Artem Mygaiev
  */
 
+#include <linux/bitops.h>
+#include <linux/kref.h>
+#include <linux/module.h>
 #include <linux/scatterlist.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
 
-#include <drm/drm_managed.h>
-#include <drm/drm_vblank.h>
-
 #include "fl2000.h"
+#include "fl2000_trace.h"
 
-/* Triple buffering:
- *  - one buffer for HDMI rendering
- *  - one buffer for USB transmission
- *  - one buffer for DRM/KMS data copy
+/* Frame URB completes once per frame period, pipeline is considered stalled if there were no
+ * completions within this number of frame periods
  */
-#define FL2000_SB_MIN 3
-#define FL2000_SB_NUM (FL2000_SB_MIN + 1)
+#define FL2000_STALL_FRAMES 2
 
+/* Stall timeout bounds, ms. Maximum one is also used while frame period is not known */
+#define FL2000_URB_TIMEOUT_MIN 10
 #define FL2000_URB_TIMEOUT 100
 
+/* Failed URBs resubmitted right away before backing off */
+#define FL2000_URB_RETRIES 3
+
+/* First backoff interval, ms, doubled with every failure up to the maximum shift */
+#define FL2000_URB_BACKOFF_MS 4
+#define FL2000_URB_BACKOFF_SHIFT_MAX 8
+
+/* Stream flags */
+#define FL2000_STREAM_CLEAR_HALT 0
+
+static int bulk_alt = -1;
+module_param(bulk_alt, int, 0444);
+MODULE_PARM_DESC(bulk_alt, "Bulk transfers altsetting, -1 for the largest burst (default: -1)");
+
+static bool isoc;
+module_param(isoc, bool, 0444);
+MODULE_PARM_DESC(isoc, "Use isochronous stream transport by default (default: false)");
+
+/* Buffers are referenced by the owner lists and by URBs of clone group members, so they are not
+ * bound to the owner DRM device lifetime
+ */
 struct fl2000_stream_buf {
 	struct list_head list;
+	struct kref ref;
 	struct fl2000 *parent;
 	struct sg_table sgt;
 	int nr_pages;
 	size_t size;
 	void *vaddr;
 	int in_flight;
+	u64 seq;
+	ktime_t commit;
 };
 
-static void fl2000_free_sb(struct fl2000_stream_buf *sb)
+static void fl2000_release_sb(struct kref *ref)
 {
+	struct fl2000_stream_buf *sb =
+		container_of(ref, struct fl2000_stream_buf, ref);
+
 	vfree(sb->vaddr);
 	sg_free_table(&sb->sgt);
-	drmm_kfree(&sb->parent->drm, sb);
+	kfree(sb);
 }
 
-static struct fl2000_stream_buf *fl2000_alloc_sb(struct fl2000 *fl2000_dev,
-						 size_t size)
+static void fl2000_free_sb(struct fl2000_stream_buf *sb)
+{
+	kref_put(&sb->ref, fl2000_release_sb);
+}
+
+/* Scatter-gather table over pages of the buffer. Every URB needs its own one, since HCD writes
+ * DMA addresses of its own mapping into it
+ */
+static int fl2000_sb_alloc_sgt(struct fl2000_stream_buf *sb,
+			       struct sg_table *sgt)
 {
-	unsigned int i, ret;
+	unsigned int i;
+	int ret;
 	struct page **pages;
 	void *ptr;
+
+	pages = kmalloc_array(sb->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0, ptr = sb->vaddr; i < sb->nr_pages; i++, ptr += PAGE_SIZE)
+		pages[i] = vmalloc_to_page(ptr);
+
+	ret = sg_alloc_table_from_pages(sgt, pages, sb->nr_pages, 0, sb->size,
+					GFP_KERNEL);
+	kfree(pages);
+
+	return ret;
+}
+
+static struct fl2000_stream_buf *fl2000_alloc_sb(struct fl2000 *fl2000_dev,
+						 size_t size)
+{
 	struct fl2000_stream_buf *sb;
 
-	sb = drmm_kzalloc(&fl2000_dev->drm, sizeof(*sb), GFP_KERNEL);
+	sb = kzalloc(sizeof(*sb), GFP_KERNEL);
 	if (!sb)
 		return NULL;
 
 	INIT_LIST_HEAD(&sb->list);
+	kref_init(&sb->ref);
 	sb->vaddr = vmalloc_32(size);
+	if (!sb->vaddr) {
+		kfree(sb);
+		return NULL;
+	}
 	memset(sb->vaddr, 0, size);
 	sb->size = size;
 	sb->in_flight = 0;
 	sb->parent = fl2000_dev;
 
 	sb->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
-	pages = kmalloc_array(sb->nr_pages, sizeof(struct page *), GFP_KERNEL);
-	if (!pages) {
-		ret = -ENOMEM;
-		goto error;
+	if (fl2000_sb_alloc_sgt(sb, &sb->sgt)) {
+		fl2000_free_sb(sb);
+		return NULL;
 	}
 
-	for (i = 0, ptr = sb->vaddr; i < sb->nr_pages; i++, ptr += PAGE_SIZE)
-		pages[i] = vmalloc_to_page(ptr);
+	return sb;
+}
 
-	ret = sg_alloc_table_from_pages(&sb->sgt, pages, sb->nr_pages, 0, size,
-					GFP_KERNEL);
-	kfree(pages);
-	if (ret != 0)
-		goto error;
+/* Free buffers from all lists, shall be called with stream stopped */
+static unsigned long fl2000_stream_put_buffers(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *cur_sb, *temp_sb;
+	unsigned long nr_pages = 0;
+	LIST_HEAD(free_list);
 
-	return sb;
+	spin_lock_irq(&fl2000_dev->list_lock);
+	list_splice_init(&fl2000_dev->render_list, &free_list);
+	list_splice_init(&fl2000_dev->transmit_list, &free_list);
+	list_splice_init(&fl2000_dev->wait_list, &free_list);
+	list_splice_init(&fl2000_dev->pending_list, &free_list);
+	spin_unlock_irq(&fl2000_dev->list_lock);
 
-error:
-	fl2000_free_sb(sb);
+	/* Stream is stopped so buffers can be freed without holding the lock */
+	list_for_each_entry_safe (cur_sb, temp_sb, &free_list, list) {
+		list_del(&cur_sb->list);
+		nr_pages += cur_sb->nr_pages;
+		fl2000_free_sb(cur_sb);
+	}
 
-	return NULL;
+	fl2000_dev->idle_pages = 0;
+
+	return nr_pages;
 }
 
-static void fl2000_stream_put_buffers(struct fl2000 *fl2000_dev)
+/* Reuse buffers retained from previous enable if they have the right size. Shall be called with
+ * stream stopped
+ */
+static int fl2000_stream_get_buffers(struct fl2000 *fl2000_dev, size_t size)
 {
+	int i = 0, ret;
 	struct fl2000_stream_buf *cur_sb, *temp_sb;
+	LIST_HEAD(free_list);
 
+	spin_lock_irq(&fl2000_dev->list_lock);
 	list_for_each_entry_safe (cur_sb, temp_sb, &fl2000_dev->render_list,
 				  list) {
-		list_del(&cur_sb->list);
-		fl2000_free_sb(cur_sb);
+		if (cur_sb->size == size && i < FL2000_SB_NUM)
+			i++;
+		else
+			list_move(&cur_sb->list, &free_list);
 	}
-	list_for_each_entry_safe (cur_sb, temp_sb, &fl2000_dev->transmit_list,
-				  list) {
-		list_del(&cur_sb->list);
-		fl2000_free_sb(cur_sb);
-	}
-	list_for_each_entry_safe (cur_sb, temp_sb, &fl2000_dev->wait_list,
-				  list) {
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	list_for_each_entry_safe (cur_sb, temp_sb, &free_list, list) {
 		list_del(&cur_sb->list);
 		fl2000_free_sb(cur_sb);
 	}
-}
-
-static int fl2000_stream_get_buffers(struct fl2000 *fl2000_dev, size_t size)
-{
-	int i, ret;
-	struct fl2000_stream_buf *cur_sb;
 
-	BUG_ON(!list_empty(&fl2000_dev->render_list));
+	fl2000_dev->idle_pages = 0;
 
-	for (i = 0; i < FL2000_SB_NUM; i++) {
+	for (; i < FL2000_SB_NUM; i++) {
 		cur_sb = fl2000_alloc_sb(fl2000_dev, size);
 		if (!cur_sb) {
 			ret = -ENOMEM;
 			goto error;
 		}
 
+		spin_lock_irq(&fl2000_dev->list_lock);
 		list_add(&cur_sb->list, &fl2000_dev->render_list);
+		spin_unlock_irq(&fl2000_dev->list_lock);
 	}
 
 	return 0;
@@ -134,43 +207,551 @@ error:
 	return ret;
 }
 
+static unsigned long fl2000_stream_shrink_count(struct shrinker *shrinker,
+						struct shrink_control *sc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct fl2000 *fl2000_dev = shrinker->private_data;
+#else
+	struct fl2000 *fl2000_dev =
+		container_of(shrinker, struct fl2000, shrinker);
+#endif
+	unsigned long idle_pages = READ_ONCE(fl2000_dev->idle_pages);
+
+	return idle_pages ? idle_pages : SHRINK_EMPTY;
+}
+
+/* Buffers are released all at once: there is no use in partial set */
+static unsigned long fl2000_stream_shrink_scan(struct shrinker *shrinker,
+					       struct shrink_control *sc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct fl2000 *fl2000_dev = shrinker->private_data;
+#else
+	struct fl2000 *fl2000_dev =
+		container_of(shrinker, struct fl2000, shrinker);
+#endif
+	unsigned long freed = 0;
+
+	/* Stream may be allocating buffers right now, and this is how we got here */
+	if (!mutex_trylock(&fl2000_dev->stream_lock))
+		return SHRINK_STOP;
+
+	if (!fl2000_dev->active)
+		freed = fl2000_stream_put_buffers(fl2000_dev);
+
+	mutex_unlock(&fl2000_dev->stream_lock);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static int fl2000_stream_shrinker_init(struct fl2000 *fl2000_dev)
+{
+	const char *name = dev_name(&fl2000_dev->usb_dev->dev);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	fl2000_dev->shrinker = shrinker_alloc(0, "fl2000-%s", name);
+	if (!fl2000_dev->shrinker)
+		return -ENOMEM;
+
+	fl2000_dev->shrinker->count_objects = fl2000_stream_shrink_count;
+	fl2000_dev->shrinker->scan_objects = fl2000_stream_shrink_scan;
+	fl2000_dev->shrinker->private_data = fl2000_dev;
+	shrinker_register(fl2000_dev->shrinker);
+
+	return 0;
+#else
+	fl2000_dev->shrinker.count_objects = fl2000_stream_shrink_count;
+	fl2000_dev->shrinker.scan_objects = fl2000_stream_shrink_scan;
+	fl2000_dev->shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&fl2000_dev->shrinker, "fl2000-%s", name);
+#endif
+}
+
+static void fl2000_stream_shrinker_release(struct fl2000 *fl2000_dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(fl2000_dev->shrinker);
+	fl2000_dev->shrinker = NULL;
+#else
+	if (fl2000_dev->shrinker.scan_objects)
+		unregister_shrinker(&fl2000_dev->shrinker);
+	fl2000_dev->shrinker.scan_objects = NULL;
+#endif
+}
+
 void fl2000_stream_release(struct fl2000 *fl2000_dev)
 {
+	fl2000_stream_shrinker_release(fl2000_dev);
 	fl2000_stream_disable(fl2000_dev);
-	destroy_workqueue(fl2000_dev->stream_work_queue);
+	cancel_work_sync(&fl2000_dev->restart_work);
+	cancel_delayed_work_sync(&fl2000_dev->watchdog);
+	cancel_delayed_work_sync(&fl2000_dev->retry_work);
+	fl2000_stream_put_buffers(fl2000_dev);
+	fl2000_isoc_release(fl2000_dev);
 }
 
-static void fl2000_stream_data_completion(struct urb *urb)
+static void fl2000_stream_restart_work(struct work_struct *work)
 {
-	struct fl2000_stream_buf *cur_sb = urb->context;
-	struct usb_device *usb_dev = urb->dev;
-	struct fl2000 *fl2000_dev = cur_sb->parent;
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, restart_work);
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	int ret;
 
-	if (!urb->status) {
-		spin_lock_irq(&fl2000_dev->list_lock);
+	fl2000_stream_pause(fl2000_dev);
+
+	if (test_and_clear_bit(FL2000_STREAM_CLEAR_HALT,
+			       &fl2000_dev->stream_flags)) {
+		ret = usb_clear_halt(usb_dev, fl2000_dev->bulk.pipe);
+		if (ret)
+			dev_err(&usb_dev->dev, "Cannot clear halt (%d)", ret);
+		else
+			fl2000_dev->stream_errors.halts_cleared++;
+	}
+
+	fl2000_dev->stream_errors.restarts++;
+
+	fl2000_stream_resume(fl2000_dev);
+}
+
+/* Can be called from atomic context */
+static void fl2000_stream_schedule_restart(struct fl2000 *fl2000_dev,
+					   bool clear_halt)
+{
+	if (clear_halt)
+		set_bit(FL2000_STREAM_CLEAR_HALT, &fl2000_dev->stream_flags);
+
+	queue_work(fl2000_stream_wq, &fl2000_dev->restart_work);
+}
+
+/* Stall timeout of the programmed mode, ms */
+static unsigned int fl2000_stream_timeout(struct fl2000 *fl2000_dev)
+{
+	s64 period_ms = ktime_to_ms(READ_ONCE(fl2000_dev->vblank.nominal));
+
+	if (!period_ms)
+		return FL2000_URB_TIMEOUT;
+
+	return clamp_t(s64, period_ms * FL2000_STALL_FRAMES,
+		       FL2000_URB_TIMEOUT_MIN, FL2000_URB_TIMEOUT);
+}
+
+static void fl2000_stream_watchdog_start(struct fl2000 *fl2000_dev)
+{
+	queue_delayed_work(fl2000_stream_wq, &fl2000_dev->watchdog,
+			   msecs_to_jiffies(fl2000_stream_timeout(fl2000_dev) /
+					    4));
+}
+
+static void fl2000_stream_watchdog(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(to_delayed_work(work), struct fl2000, watchdog);
+	unsigned long last_completion = READ_ONCE(fl2000_dev->last_completion);
+
+	if (!READ_ONCE(fl2000_dev->enabled))
+		return;
+
+	/* Stream always keeps URBs in flight, even if there are no new frames, unless it backs off
+	 * after errors
+	 */
+	if (!delayed_work_pending(&fl2000_dev->retry_work) &&
+	    time_after(jiffies,
+		       last_completion +
+			       msecs_to_jiffies(fl2000_stream_timeout(fl2000_dev)))) {
+		dev_warn_ratelimited(&fl2000_dev->usb_dev->dev,
+				     "Stream stalled, restarting");
+		fl2000_dev->stream_errors.stalls++;
+		fl2000_stream_schedule_restart(fl2000_dev, true);
+		return;
+	}
+
+	fl2000_stream_watchdog_start(fl2000_dev);
+}
+
+static void fl2000_stream_retry_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(to_delayed_work(work), struct fl2000, retry_work);
+
+	queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
+}
+
+/* Decide if the next submission after a completion can go right away. Failures are retried
+ * immediately a few times, then with exponential backoff, so that an error storm does not turn
+ * into a resubmission loop. Can be called from atomic context
+ */
+static bool fl2000_stream_retry(struct fl2000 *fl2000_dev, bool failed)
+{
+	unsigned int streak, shift;
+
+	if (!failed) {
+		WRITE_ONCE(fl2000_dev->error_streak, 0);
+		return true;
+	}
+
+	streak = ++fl2000_dev->error_streak;
+	if (streak <= FL2000_URB_RETRIES)
+		return true;
+
+	shift = min(streak - FL2000_URB_RETRIES - 1,
+		    FL2000_URB_BACKOFF_SHIFT_MAX);
+	fl2000_dev->stream_errors.backoffs++;
+	queue_delayed_work(fl2000_stream_wq, &fl2000_dev->retry_work,
+			   msecs_to_jiffies(FL2000_URB_BACKOFF_MS << shift));
+
+	return false;
+}
+
+/* Track intervals between completions, jitter is the mean difference of adjacent intervals */
+static void fl2000_stream_jitter(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_jitter *jitter = &fl2000_dev->stream_jitter;
+	ktime_t now = ktime_get();
+	s64 interval;
+
+	if (jitter->last) {
+		interval = ktime_us_delta(now, jitter->last);
+		if (jitter->intervals) {
+			jitter->min_us = min(jitter->min_us, interval);
+			jitter->max_us = max(jitter->max_us, interval);
+			jitter->sum_dev_us += abs(interval - jitter->last_us);
+		} else {
+			jitter->min_us = interval;
+			jitter->max_us = interval;
+		}
+		jitter->sum_us += interval;
+		jitter->last_us = interval;
+		jitter->intervals++;
+	}
+	jitter->last = now;
+}
+
+/* Bucket N holds durations below 2^N us */
+static void fl2000_hist_add(struct fl2000_hist *hist, s64 us)
+{
+	unsigned int bucket;
+
+	if (us < 0)
+		us = 0;
+
+	bucket = min(fls64(us), FL2000_HIST_BUCKETS - 1);
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum_us += us;
+	hist->max_us = max_t(u64, hist->max_us, us);
+}
+
+/* Return buffer from the failed or completed URB back to the pipeline */
+static void fl2000_stream_recycle(struct fl2000 *fl2000_dev,
+				  struct fl2000_stream_buf *cur_sb)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fl2000_dev->list_lock, flags);
+	/* Stream may be stopped in the meantime, with buffer already recycled */
+	if (cur_sb->in_flight) {
 		cur_sb->in_flight--;
 		/* Move back to render_list if completed */
 		if (!cur_sb->in_flight) {
 			list_move_tail(&cur_sb->list, &fl2000_dev->render_list);
+			trace_fl2000_buf_state(fl2000_dev->usb_dev, cur_sb->seq,
+					       cur_sb, FL2000_SB_RENDER);
 		}
-		spin_unlock(&fl2000_dev->list_lock);
+	}
+	spin_unlock_irqrestore(&fl2000_dev->list_lock, flags);
+}
+
+static void fl2000_stream_complete(struct fl2000 *fl2000_dev, struct urb *urb,
+				   u64 seq)
+{
+	struct fl2000_stream_errors *errors = &fl2000_dev->stream_errors;
+	bool failed = false;
 
-		/* Schedule another URB */
-		complete(&fl2000_dev->stream_complete);
+	trace_fl2000_urb_complete(fl2000_dev->usb_dev, seq, urb->status,
+				  urb->actual_length);
+	if (!urb->status) {
+		WRITE_ONCE(fl2000_dev->shown_seq, seq);
+		fl2000_crc_shown(fl2000_dev, seq);
+	}
 
-		fl2000_urb_status(usb_dev, urb->status, urb->pipe);
+	atomic_dec(&fl2000_dev->urbs_in_flight);
+	WRITE_ONCE(fl2000_dev->last_completion, jiffies);
+	fl2000_stream_jitter(fl2000_dev);
+	fl2000_pacing_completed(fl2000_dev);
+
+	switch (urb->status) {
+	case 0:
+		break;
+	/* Unlinked or killed, device is going away */
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		break;
+	/* Stalled endpoint, needs clearing halt from process context */
+	case -EPIPE:
+		errors->urb_errors++;
+		fl2000_stream_schedule_restart(fl2000_dev, true);
+		failed = true;
+		break;
+	default:
+		errors->urb_errors++;
+		failed = true;
+		break;
 	}
 
-	// Send a vblank event even when there is an error
-	drm_crtc_handle_vblank(&fl2000_dev->pipe.crtc);
+	/* Schedule another URB */
+	atomic_inc(&fl2000_dev->stream_credits);
+	if (fl2000_stream_retry(fl2000_dev, failed))
+		queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
 
 	usb_free_urb(urb);
 }
 
-static void fl2000_stream_zero_length_completion(struct urb *urb) {
+static void fl2000_stream_data_completion(struct urb *urb)
+{
+	struct fl2000_stream_buf *cur_sb = urb->context;
+	struct fl2000 *fl2000_dev = cur_sb->parent;
+
+	u64 seq = cur_sb->seq;
+
+	fl2000_dev->bulk.bytes += urb->actual_length;
+	fl2000_dev->stream_stats.bytes += urb->actual_length;
+
+	/* Frame is retransmitted until replaced, latency is measured on its first showing */
+	if (!urb->status && cur_sb->commit) {
+		fl2000_hist_add(&fl2000_dev->stream_stats.latency,
+				ktime_us_delta(ktime_get(), cur_sb->commit));
+		cur_sb->commit = 0;
+	}
+
+	fl2000_stream_recycle(fl2000_dev, cur_sb);
+	fl2000_stream_complete(fl2000_dev, urb, seq);
+}
+
+/* Buffer of the clone group leader, which can be gone by now. Follower is on another HCD and has
+ * its own scatter-gather table over the same pages
+ */
+struct fl2000_clone_urb {
+	struct fl2000 *fl2000_dev;
+	struct fl2000_stream_buf *sb;
+	struct sg_table sgt;
+};
+
+static void fl2000_stream_clone_completion(struct urb *urb)
+{
+	struct fl2000_clone_urb *clone_urb = urb->context;
+	struct fl2000 *fl2000_dev = clone_urb->fl2000_dev;
+	u64 seq = clone_urb->sb->seq;
+
+	fl2000_dev->bulk.bytes += urb->actual_length;
+	fl2000_dev->stream_stats.bytes += urb->actual_length;
+
+	sg_free_table(&clone_urb->sgt);
+	fl2000_free_sb(clone_urb->sb);
+	kfree(clone_urb);
+	fl2000_stream_complete(fl2000_dev, urb, seq);
+}
+
+/**
+ * fl2000_stream_clone_buf() - get the frame that is being streamed by the device
+ * @fl2000_dev:	FL2000 device, clone group leader
+ *
+ * Can be called from atomic context
+ *
+ * Return: Referenced stream buffer or NULL if nothing is streamed
+ */
+struct fl2000_stream_buf *fl2000_stream_clone_buf(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *cur_sb = NULL;
+	unsigned long flags;
+
+	/* Referenced buffer is not overwritten by the owner, so the newest one can be taken even if
+	 * the owner has not submitted it yet
+	 */
+	spin_lock_irqsave(&fl2000_dev->list_lock, flags);
+	if (!list_empty(&fl2000_dev->transmit_list))
+		cur_sb = list_last_entry(&fl2000_dev->transmit_list,
+					 struct fl2000_stream_buf, list);
+	else if (!list_empty(&fl2000_dev->wait_list))
+		cur_sb = list_last_entry(&fl2000_dev->wait_list,
+					 struct fl2000_stream_buf, list);
+	if (cur_sb)
+		kref_get(&cur_sb->ref);
+	spin_unlock_irqrestore(&fl2000_dev->list_lock, flags);
+
+	return cur_sb;
+}
+
+static void fl2000_stream_zero_length_completion(struct urb *urb)
+{
+	struct fl2000 *fl2000_dev = urb->context;
+
+	if (urb->status == -EPIPE)
+		fl2000_stream_schedule_restart(fl2000_dev, true);
+
 	usb_free_urb(urb);
 }
-/* TODO: convert to tasklet */
+
+/* Take the next frame to transmit and mark it in flight */
+static struct fl2000_stream_buf *fl2000_stream_pick(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *cur_sb;
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+
+	/* If no buffers are available for immediate transmission - then copy latest
+	 * transmission data
+	 */
+	if (list_empty(&fl2000_dev->transmit_list)) {
+		fl2000_dev->stream_stats.retransmitted++;
+		if (list_empty(&fl2000_dev->wait_list)) {
+			cur_sb = list_last_entry(&fl2000_dev->render_list,
+						 struct fl2000_stream_buf,
+						 list);
+		} else {
+			cur_sb = list_last_entry(&fl2000_dev->wait_list,
+						 struct fl2000_stream_buf,
+						 list);
+		}
+	} else {
+		/* Paced stream shows the newest frame, older ones are skipped */
+		while (fl2000_pacing_active(fl2000_dev) &&
+		       !list_is_singular(&fl2000_dev->transmit_list)) {
+			list_move_tail(fl2000_dev->transmit_list.next,
+				       &fl2000_dev->render_list);
+			fl2000_dev->pacing.skipped++;
+		}
+		cur_sb = list_first_entry(&fl2000_dev->transmit_list,
+					  struct fl2000_stream_buf, list);
+	}
+
+	cur_sb->in_flight++;
+	list_move_tail(&cur_sb->list, &fl2000_dev->wait_list);
+	trace_fl2000_buf_state(fl2000_dev->usb_dev, cur_sb->seq, cur_sb,
+			       FL2000_SB_WAIT);
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	return cur_sb;
+}
+
+static void fl2000_stream_isoc_completion(struct urb *urb)
+{
+	struct fl2000_isoc_urb *iurb = urb->context;
+	struct fl2000 *fl2000_dev = iurb->fl2000_dev;
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	unsigned int i;
+	bool failed = false;
+
+	trace_fl2000_urb_complete(fl2000_dev->usb_dev, iurb->seq, urb->status,
+				  urb->actual_length);
+
+	atomic_dec(&fl2000_dev->urbs_in_flight);
+	WRITE_ONCE(fl2000_dev->last_completion, jiffies);
+	fl2000_dev->stream_stats.bytes += urb->actual_length;
+
+	if (!urb->status) {
+		for (i = 0; i < urb->number_of_packets; i++)
+			if (urb->iso_frame_desc[i].status)
+				isoc->packet_errors++;
+	} else if (urb->status != -ENOENT && urb->status != -ECONNRESET &&
+		   urb->status != -ESHUTDOWN && urb->status != -ENODEV) {
+		fl2000_dev->stream_errors.urb_errors++;
+		failed = true;
+	}
+
+	/* Pool URB is free for the next chunk */
+	set_bit(iurb->index, &isoc->idle);
+	if (fl2000_stream_retry(fl2000_dev, failed))
+		queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
+
+	if (iurb->frame_end) {
+		if (!urb->status) {
+			WRITE_ONCE(fl2000_dev->shown_seq, iurb->seq);
+			fl2000_crc_shown(fl2000_dev, iurb->seq);
+		}
+		fl2000_stream_jitter(fl2000_dev);
+	}
+}
+
+/* Feeds frames to the isochronous URB pool chunk by chunk. Frame buffer is recycled as soon as its
+ * last chunk is copied
+ */
+static void fl2000_stream_isoc_work(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_isoc *isoc = &fl2000_dev->isoc;
+	struct fl2000_isoc_urb *iurb;
+	unsigned int i;
+	size_t len;
+	bool frame_end;
+	int ret;
+
+	while (READ_ONCE(fl2000_dev->enabled)) {
+		i = find_first_bit(&isoc->idle, FL2000_ISOC_URBS);
+		if (i >= FL2000_ISOC_URBS)
+			break;
+		clear_bit(i, &isoc->idle);
+		iurb = &isoc->urbs[i];
+
+		if (!isoc->sb) {
+			isoc->sb = fl2000_stream_pick(fl2000_dev);
+			isoc->offset = 0;
+			fl2000_crc_frame(fl2000_dev, isoc->sb->vaddr,
+					 isoc->sb->size, isoc->sb->seq);
+		}
+
+		len = min(isoc->sb->size - isoc->offset, isoc->buf_size);
+		frame_end = isoc->offset + len == isoc->sb->size;
+
+		iurb->seq = isoc->sb->seq;
+		trace_fl2000_urb_submit(fl2000_dev->usb_dev, iurb->seq, len);
+
+		atomic_inc(&fl2000_dev->urbs_in_flight);
+		ret = fl2000_isoc_submit(fl2000_dev, iurb,
+					 isoc->sb->vaddr + isoc->offset, len,
+					 frame_end,
+					 fl2000_stream_isoc_completion);
+		if (ret) {
+			usb_unanchor_urb(iurb->urb);
+			atomic_dec(&fl2000_dev->urbs_in_flight);
+			set_bit(i, &isoc->idle);
+			fl2000_dev->stream_errors.submit_errors++;
+			if (ret == -ENODEV || ret == -ESHUTDOWN)
+				fl2000_dev->enabled = false;
+			else
+				fl2000_stream_schedule_restart(fl2000_dev,
+							       false);
+			break;
+		}
+
+		isoc->offset += len;
+		if (frame_end) {
+			fl2000_stream_recycle(fl2000_dev, isoc->sb);
+			isoc->sb = NULL;
+		}
+	}
+}
+
+/* Drop buffer that was picked for submission but not submitted */
+static void fl2000_stream_unclaim(struct fl2000 *fl2000_dev,
+				  struct fl2000_stream_buf *cur_sb,
+				  struct fl2000_clone_urb *clone_urb)
+{
+	if (clone_urb) {
+		sg_free_table(&clone_urb->sgt);
+		fl2000_free_sb(cur_sb);
+		kfree(clone_urb);
+	} else {
+		fl2000_stream_recycle(fl2000_dev, cur_sb);
+	}
+}
+
+/* Submits as many URBs as there are credits and returns, so that shared workqueue is never blocked
+ * by a single device. Every completion returns a credit and requeues the work. Paced stream is
+ * requeued by pacing timer instead
+ */
 static void fl2000_stream_work(struct work_struct *work)
 {
 	int ret;
@@ -178,82 +759,120 @@ static void fl2000_stream_work(struct work_struct *work)
 		container_of(work, struct fl2000, stream_work);
 	struct usb_device *usb_dev = fl2000_dev->usb_dev;
 	struct fl2000_stream_buf *cur_sb;
+	struct fl2000_clone_urb *clone_urb;
 	struct urb *data_urb, *zero_urb;
-	int max_packet = usb_maxpacket(fl2000_dev->usb_dev, usb_sndbulkpipe(usb_dev, 1));
-
-
-	while (fl2000_dev->enabled) {
-		ret = wait_for_completion_interruptible(&fl2000_dev->stream_complete);
-		if (ret) {
-			dev_err(&usb_dev->dev, "Work interrupt error %d", ret);
-			break;
-		}
-		if (!fl2000_dev->enabled)
-			break;
+	int max_packet = usb_maxpacket(usb_dev, fl2000_dev->bulk.pipe);
 
-		spin_lock_irq(&fl2000_dev->list_lock);
+	if (fl2000_dev->transport == FL2000_TRANSPORT_ISOC) {
+		fl2000_stream_isoc_work(fl2000_dev);
+		return;
+	}
 
-		/* If no buffers are available for immediate transmission - then copy latest
-		 * transmission data
-		 */
-		if (list_empty(&fl2000_dev->transmit_list)) {
-			if (list_empty(&fl2000_dev->wait_list)) {
-				cur_sb = list_last_entry(
-					&fl2000_dev->render_list,
-					struct fl2000_stream_buf, list);
-			} else {
-				cur_sb = list_last_entry(
-					&fl2000_dev->wait_list,
-					struct fl2000_stream_buf, list);
+	while (READ_ONCE(fl2000_dev->enabled) &&
+	       atomic_read(&fl2000_dev->stream_credits) &&
+	       !fl2000_pacing_hold(fl2000_dev) &&
+	       atomic_add_unless(&fl2000_dev->stream_credits, -1, 0)) {
+		/* Queue depth was reduced, drop this submission slot */
+		if (atomic_add_unless(&fl2000_dev->depth_debt, -1, 0))
+			continue;
+
+		/* Clone group member streams frames converted by the leader */
+		clone_urb = NULL;
+		cur_sb = fl2000_clone_get_buf(fl2000_dev);
+		if (cur_sb) {
+			clone_urb = kmalloc(sizeof(*clone_urb), GFP_KERNEL);
+			if (clone_urb &&
+			    !fl2000_sb_alloc_sgt(cur_sb, &clone_urb->sgt)) {
+				clone_urb->fl2000_dev = fl2000_dev;
+				clone_urb->sb = cur_sb;
+				goto submit;
 			}
-		} else {
-			cur_sb = list_first_entry(&fl2000_dev->transmit_list,
-						  struct fl2000_stream_buf,
-						  list);
+			kfree(clone_urb);
+			clone_urb = NULL;
+			fl2000_free_sb(cur_sb);
 		}
 
-		cur_sb->in_flight++;
-		list_move_tail(&cur_sb->list, &fl2000_dev->wait_list);
-		spin_unlock(&fl2000_dev->list_lock);
+		cur_sb = fl2000_stream_pick(fl2000_dev);
 
+submit:
 		data_urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (!data_urb) {
 			dev_err(&usb_dev->dev, "Data URB allocation error");
+			fl2000_stream_unclaim(fl2000_dev, cur_sb, clone_urb);
+			fl2000_dev->stream_errors.submit_errors++;
+			fl2000_stream_schedule_restart(fl2000_dev, false);
 			break;
 		}
-		
+
 		/* Endpoint 1 bulk out */
-		usb_fill_bulk_urb(data_urb, usb_dev,
-				  usb_sndbulkpipe(usb_dev, 1), cur_sb->vaddr,
-				  cur_sb->size,
-				  fl2000_stream_data_completion, cur_sb);
+		if (clone_urb)
+			usb_fill_bulk_urb(data_urb, usb_dev,
+					  fl2000_dev->bulk.pipe,
+					  cur_sb->vaddr, cur_sb->size,
+					  fl2000_stream_clone_completion,
+					  clone_urb);
+		else
+			usb_fill_bulk_urb(data_urb, usb_dev,
+					  fl2000_dev->bulk.pipe,
+					  cur_sb->vaddr, cur_sb->size,
+					  fl2000_stream_data_completion, cur_sb);
 		data_urb->interval = 0;
-		data_urb->sg = cur_sb->sgt.sgl;
-		data_urb->num_sgs = cur_sb->sgt.nents;
+		if (clone_urb) {
+			data_urb->sg = clone_urb->sgt.sgl;
+			data_urb->num_sgs = clone_urb->sgt.nents;
+		} else {
+			data_urb->sg = cur_sb->sgt.sgl;
+			data_urb->num_sgs = cur_sb->sgt.nents;
+		}
 		if (!(cur_sb->size % max_packet))
 			data_urb->transfer_flags |= URB_ZERO_PACKET;
 
+		trace_fl2000_urb_submit(usb_dev, cur_sb->seq, cur_sb->size);
+
+		/* Buffer may be recycled as soon as it is submitted */
+		fl2000_crc_frame(fl2000_dev, cur_sb->vaddr, cur_sb->size,
+				 cur_sb->seq);
+
 		usb_anchor_urb(data_urb, &fl2000_dev->anchor);
+		atomic_inc(&fl2000_dev->urbs_in_flight);
 		ret = fl2000_submit_urb(data_urb);
 		if (ret) {
 			usb_unanchor_urb(data_urb);
 			usb_free_urb(data_urb);
-			fl2000_dev->enabled = false;
+			atomic_dec(&fl2000_dev->urbs_in_flight);
+			fl2000_stream_unclaim(fl2000_dev, cur_sb, clone_urb);
+			fl2000_dev->stream_errors.submit_errors++;
+			/* No way to recover if device is gone */
+			if (ret == -ENODEV || ret == -ESHUTDOWN)
+				fl2000_dev->enabled = false;
+			else
+				fl2000_stream_schedule_restart(fl2000_dev,
+							       ret == -EPIPE);
 			break;
 		}
+		fl2000_pacing_submitted(fl2000_dev);
+
 		/* HW expects a zero length packet even if last packet is a short packet */
 		if (cur_sb->size % max_packet) {
 			zero_urb = usb_alloc_urb(0, GFP_KERNEL);
+			if (!zero_urb) {
+				fl2000_dev->stream_errors.submit_errors++;
+				fl2000_stream_schedule_restart(fl2000_dev,
+							       false);
+				break;
+			}
 			usb_anchor_urb(zero_urb, &fl2000_dev->anchor);
 			usb_fill_bulk_urb(zero_urb, usb_dev,
-						usb_sndbulkpipe(usb_dev, 1), NULL,
+						fl2000_dev->bulk.pipe, NULL,
 						0,
-						fl2000_stream_zero_length_completion, zero_urb);
+						fl2000_stream_zero_length_completion, fl2000_dev);
 			ret = fl2000_submit_urb(zero_urb);
 			if (ret) {
 				usb_unanchor_urb(zero_urb);
 				usb_free_urb(zero_urb);
-				fl2000_dev->enabled = false;
+				fl2000_dev->stream_errors.submit_errors++;
+				fl2000_stream_schedule_restart(fl2000_dev,
+							       ret == -EPIPE);
 				break;
 			}
 		}
@@ -298,23 +917,88 @@ static void fl2000_xrgb888_to_rgb233_line(u8 *dbuf, u32 *sbuf, u32 pixels)
 	}
 }
 
+/* Decode line of stream buffer back to XRGB8888, used when stream format changes in flight */
+static void fl2000_stream_decode_line(u32 *dbuf, void *sbuf, u32 pixels,
+				      u32 bytes_pix)
+{
+	unsigned int x, xx = 0;
+	u8 *sbuf8 = sbuf;
+	u16 *sbuf16 = sbuf;
+	u32 r, g, b;
+
+	for (x = 0; x < pixels; x++) {
+		switch (bytes_pix) {
+		case 1:
+			r = (sbuf8[x ^ 4] >> 6) & 0x3;
+			g = (sbuf8[x ^ 4] >> 3) & 0x7;
+			b = sbuf8[x ^ 4] & 0x7;
+			r = r * 0x55;
+			g = (g << 5) | (g << 2) | (g >> 1);
+			b = (b << 5) | (b << 2) | (b >> 1);
+			break;
+		case 2:
+			r = (sbuf16[x ^ 2] >> 11) & 0x1F;
+			g = (sbuf16[x ^ 2] >> 5) & 0x3F;
+			b = sbuf16[x ^ 2] & 0x1F;
+			r = (r << 3) | (r >> 2);
+			g = (g << 2) | (g >> 4);
+			b = (b << 3) | (b >> 2);
+			break;
+		default:
+			b = sbuf8[xx++ ^ 4];
+			g = sbuf8[xx++ ^ 4];
+			r = sbuf8[xx++ ^ 4];
+			break;
+		}
+		dbuf[x] = (r << 16) | (g << 8) | b;
+	}
+}
+
+/* Shall be called with list lock held */
+static void fl2000_stream_encode_line(struct fl2000 *fl2000_dev, void *dst,
+				      u32 *src, unsigned int width)
+{
+	switch (fl2000_dev->bytes_pix) {
+	case 1:
+		fl2000_xrgb888_to_rgb233_line(dst, src, width);
+		break;
+	case 2:
+		fl2000_xrgb888_to_rgb565_line(dst, src, width);
+		break;
+	case 3:
+		fl2000_xrgb888_to_rgb888_line(dst, src, width);
+		break;
+	default: /* Shouldn't happen */
+		break;
+	}
+}
+
 void fl2000_stream_compress(struct fl2000 *fl2000_dev, void *src,
 			    unsigned int height, unsigned int width,
-			    unsigned int pitch)
+			    unsigned int pitch, u64 seq)
 {
 	struct fl2000_stream_buf *cur_sb;
 	unsigned int y;
 	void *dst;
 	u32 dst_line_len;
+	bool found = false;
+	ktime_t start = ktime_get();
 
 	spin_lock_irq(&fl2000_dev->list_lock);
 
+	/* Skip buffers still streamed by clone group members */
+	list_for_each_entry (cur_sb, &fl2000_dev->render_list, list) {
+		if (kref_read(&cur_sb->ref) == 1) {
+			found = true;
+			break;
+		}
+	}
+
 	/* Drop frames if sending frames too fast */
-	if (list_empty(&fl2000_dev->render_list))
+	if (!found) {
+		fl2000_dev->stream_stats.dropped++;
 		goto list_empty;
-
-	cur_sb = list_first_entry(&fl2000_dev->render_list,
-				  struct fl2000_stream_buf, list);
+	}
 
 	/* Reallocate buffers which are the wrong size */
 	if (cur_sb->size != fl2000_dev->buf_size) {
@@ -326,38 +1010,100 @@ void fl2000_stream_compress(struct fl2000 *fl2000_dev, void *src,
 	}
 	dst = cur_sb->vaddr;
 	dst_line_len = width * fl2000_dev->bytes_pix;
+	cur_sb->seq = seq;
+	cur_sb->commit = start;
 
+	trace_fl2000_convert_start(fl2000_dev->usb_dev, seq, height,
+				   height * dst_line_len);
 	for (y = 0; y < height; y++) {
-		switch (fl2000_dev->bytes_pix) {
-		case 1:
-			fl2000_xrgb888_to_rgb233_line(dst, src, width);
-			break;
-		case 2:
-			fl2000_xrgb888_to_rgb565_line(dst, src, width);
-			break;
-		case 3:
-			fl2000_xrgb888_to_rgb888_line(dst, src, width);
-			break;
-		default: /* Shouldn't happen */
-			break;
-		}
+		fl2000_stream_encode_line(fl2000_dev, dst, src, width);
 		src += pitch;
 		dst += dst_line_len;
 	}
-	list_move_tail(&cur_sb->list, &fl2000_dev->transmit_list);
+	trace_fl2000_convert_end(fl2000_dev->usb_dev, seq, height,
+				 height * dst_line_len);
+
+	fl2000_dev->stream_stats.converted++;
+	fl2000_hist_add(&fl2000_dev->stream_stats.convert,
+			ktime_us_delta(ktime_get(), start));
+
+	/* Frames of tiled group are held until all tiles are converted */
+	if (READ_ONCE(fl2000_dev->tile.group)) {
+		list_splice_tail_init(&fl2000_dev->pending_list,
+				      &fl2000_dev->render_list);
+		list_move_tail(&cur_sb->list, &fl2000_dev->pending_list);
+		trace_fl2000_buf_state(fl2000_dev->usb_dev, seq, cur_sb,
+				       FL2000_SB_PENDING);
+	} else {
+		list_move_tail(&cur_sb->list, &fl2000_dev->transmit_list);
+		trace_fl2000_buf_state(fl2000_dev->usb_dev, seq, cur_sb,
+				       FL2000_SB_TRANSMIT);
+	}
 
 list_empty:
-	spin_unlock(&fl2000_dev->list_lock);
+	spin_unlock_irq(&fl2000_dev->list_lock);
+}
+
+bool fl2000_stream_tile_pending(struct fl2000 *fl2000_dev)
+{
+	bool pending;
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	pending = !list_empty(&fl2000_dev->pending_list);
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	return pending;
+}
+
+/* Release held frame for transmission */
+bool fl2000_stream_tile_flip(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *cur_sb;
+	bool pending;
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	pending = !list_empty(&fl2000_dev->pending_list);
+	list_for_each_entry (cur_sb, &fl2000_dev->pending_list, list)
+		trace_fl2000_buf_state(fl2000_dev->usb_dev, cur_sb->seq, cur_sb,
+				       FL2000_SB_TRANSMIT);
+	list_splice_tail_init(&fl2000_dev->pending_list,
+			      &fl2000_dev->transmit_list);
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	return pending;
+}
+
+/* Pages of all stream buffers, whether streamed or idle */
+unsigned long fl2000_stream_pages(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_stream_buf *cur_sb;
+	unsigned long nr_pages = 0;
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	list_for_each_entry (cur_sb, &fl2000_dev->render_list, list)
+		nr_pages += cur_sb->nr_pages;
+	list_for_each_entry (cur_sb, &fl2000_dev->pending_list, list)
+		nr_pages += cur_sb->nr_pages;
+	list_for_each_entry (cur_sb, &fl2000_dev->transmit_list, list)
+		nr_pages += cur_sb->nr_pages;
+	list_for_each_entry (cur_sb, &fl2000_dev->wait_list, list)
+		nr_pages += cur_sb->nr_pages;
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	return nr_pages;
 }
 
-int fl2000_stream_mode_set(struct fl2000 *fl2000_dev, int pixels, u32 bytes_pix)
+int fl2000_stream_mode_set(struct fl2000 *fl2000_dev, u32 width, u32 height,
+			   u32 bytes_pix)
 {
 	size_t size;
 
 	/* Round buffer size up to multiple of 8 to meet HW expectations */
-	size = round_up(pixels * bytes_pix, 8);
+	size = round_up(width * height * bytes_pix, 8);
 
 	spin_lock_irq(&fl2000_dev->list_lock);
+	fl2000_dev->width = width;
+	fl2000_dev->height = height;
 	fl2000_dev->bytes_pix = bytes_pix;
 	fl2000_dev->buf_size = size;
 	spin_unlock_irq(&fl2000_dev->list_lock);
@@ -365,53 +1111,440 @@ int fl2000_stream_mode_set(struct fl2000 *fl2000_dev, int pixels, u32 bytes_pix)
 	return 0;
 }
 
-int fl2000_stream_enable(struct fl2000 *fl2000_dev)
+/**
+ * fl2000_stream_set_format() - change bytes per pixel of running stream
+ * @fl2000_dev:	FL2000 device
+ * @bytes_pix:	new number of bytes per pixel
+ *
+ * Only pixel format and stream buffers are changed, mode is kept. The latest frame is re-encoded
+ * in the new format, so that picture stays on screen until next update. Buffers of the new size
+ * are allocated before anything is changed, so on failure the stream is left as it was
+ *
+ * Return: Operation result
+ */
+int fl2000_stream_set_format(struct fl2000 *fl2000_dev, u32 bytes_pix)
 {
-	int i;
+	struct fl2000_stream_buf *old_sb = NULL, *new_sb, *cur_sb, *temp_sb;
+	u32 width = fl2000_dev->width, height = fl2000_dev->height;
+	u32 old_bytes_pix = fl2000_dev->bytes_pix;
+	size_t size = round_up(width * height * bytes_pix, 8);
+	LIST_HEAD(new_list);
+	LIST_HEAD(free_list);
+	unsigned int i, y;
+	u32 *line;
+	int ret;
 
-	/* Initialize the queue with buffers */
-	fl2000_stream_get_buffers(fl2000_dev, fl2000_dev->buf_size);
+	if (bytes_pix == old_bytes_pix)
+		return 0;
+
+	line = kmalloc_array(width, sizeof(*line), GFP_KERNEL);
+	if (!line)
+		return -ENOMEM;
+
+	new_sb = fl2000_alloc_sb(fl2000_dev, size);
+	if (!new_sb) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < FL2000_SB_NUM; i++) {
+		cur_sb = fl2000_alloc_sb(fl2000_dev, size);
+		if (!cur_sb) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		list_add(&cur_sb->list, &new_list);
+	}
+
+	fl2000_stream_pause(fl2000_dev);
+	mutex_lock(&fl2000_dev->stream_lock);
+
+	/* Modeset or disable could have happened meanwhile */
+	if (!fl2000_dev->active || fl2000_dev->bytes_pix != old_bytes_pix) {
+		ret = -EAGAIN;
+		goto unlock;
+	}
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	fl2000_dev->bytes_pix = bytes_pix;
+	fl2000_dev->buf_size = size;
+
+	/* Stopped stream has put the latest frame for transmission */
+	if (!list_empty(&fl2000_dev->transmit_list))
+		old_sb = list_last_entry(&fl2000_dev->transmit_list,
+					 struct fl2000_stream_buf, list);
+	if (old_sb && old_sb->size >= width * height * old_bytes_pix) {
+		new_sb->seq = old_sb->seq;
+		for (y = 0; y < height; y++) {
+			fl2000_stream_decode_line(line,
+						  old_sb->vaddr +
+							  y * width * old_bytes_pix,
+						  width, old_bytes_pix);
+			fl2000_stream_encode_line(fl2000_dev,
+						  new_sb->vaddr +
+							  y * width * bytes_pix,
+						  line, width);
+		}
+	}
 
-	reinit_completion(&fl2000_dev->stream_complete);
+	/* Buffers of the old size are replaced, stopped stream has none in flight */
+	list_splice_tail_init(&fl2000_dev->transmit_list, &free_list);
+	list_splice_tail_init(&fl2000_dev->pending_list, &free_list);
+	list_splice_tail_init(&fl2000_dev->render_list, &free_list);
+	list_splice_tail_init(&new_list, &fl2000_dev->render_list);
+	list_add_tail(&new_sb->list, &fl2000_dev->transmit_list);
+	new_sb = NULL;
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	fl2000_dev->idle_pages = 0;
+	fl2000_set_pixfmt(fl2000_dev->usb_dev, bytes_pix);
+	ret = 0;
 
+unlock:
+	mutex_unlock(&fl2000_dev->stream_lock);
+	fl2000_stream_resume(fl2000_dev);
+
+free:
+	list_splice_tail_init(&new_list, &free_list);
+	list_for_each_entry_safe (cur_sb, temp_sb, &free_list, list) {
+		list_del(&cur_sb->list);
+		fl2000_free_sb(cur_sb);
+	}
+	if (new_sb)
+		fl2000_free_sb(new_sb);
+	kfree(line);
+
+	return ret;
+}
+
+/* Record sustained throughput of the bulk altsetting over the stream run */
+static void fl2000_stream_account(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_bulk *bulk = &fl2000_dev->bulk;
+	struct fl2000_bulk_stats *stats;
+
+	if (fl2000_dev->transport != FL2000_TRANSPORT_BULK ||
+	    bulk->altsetting >= FL2000_BULK_ALTS_MAX)
+		return;
+
+	stats = &bulk->stats[bulk->altsetting];
+	stats->bytes += bulk->bytes;
+	stats->us += ktime_us_delta(ktime_get(), fl2000_dev->stream_start);
+}
+
+/* Shall be called with stream lock held */
+static void fl2000_stream_start(struct fl2000 *fl2000_dev)
+{
 	/* Pipeline bulk URBs */
-	for (i = 0; i < FL2000_SB_MIN; i++)
-		complete(&fl2000_dev->stream_complete);
+	atomic_set(&fl2000_dev->stream_credits, fl2000_dev->queue_depth);
+	atomic_set(&fl2000_dev->depth_debt, 0);
+
+	/* Whole isochronous URB pool is idle */
+	fl2000_dev->isoc.idle = GENMASK(FL2000_ISOC_URBS - 1, 0);
+	fl2000_dev->isoc.sb = NULL;
 
 	fl2000_dev->enabled = true;
+	fl2000_dev->last_completion = jiffies;
+	fl2000_dev->error_streak = 0;
+	fl2000_dev->bulk.bytes = 0;
+	fl2000_dev->stream_stats.run_bytes = fl2000_dev->stream_stats.bytes;
+	fl2000_dev->stream_start = ktime_get();
+	fl2000_dev->stream_jitter.last = 0;
+	fl2000_pacing_start(fl2000_dev);
+	fl2000_telemetry_start(fl2000_dev);
+
+	queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
+
+	fl2000_stream_watchdog_start(fl2000_dev);
+}
+
+/* Shall be called with stream lock held. Buffers are kept, the latest transmitted frame is put
+ * back for transmission so that restarted stream begins with a full frame
+ */
+static void fl2000_stream_stop(struct fl2000 *fl2000_dev, bool graceful)
+{
+	struct fl2000_stream_buf *cur_sb, *temp_sb;
+	bool resend;
 
-	queue_work(fl2000_dev->stream_work_queue, &fl2000_dev->stream_work);
+	WRITE_ONCE(fl2000_dev->enabled, false);
 
-	return 0;
+	fl2000_telemetry_stop(fl2000_dev);
+	cancel_work_sync(&fl2000_dev->stream_work);
+	cancel_delayed_work_sync(&fl2000_dev->watchdog);
+
+	if (!graceful ||
+	    !usb_wait_anchor_empty_timeout(&fl2000_dev->anchor, 1000))
+		usb_kill_anchored_urbs(&fl2000_dev->anchor);
+
+	/* Completions of the last URBs have requeued the work, directly or with backoff */
+	cancel_delayed_work_sync(&fl2000_dev->retry_work);
+	cancel_work_sync(&fl2000_dev->stream_work);
+
+	/* Stream work may have armed pacing timer until now. Work queued by its last expiry sees the
+	 * stream disabled and does nothing
+	 */
+	fl2000_pacing_stop(fl2000_dev);
+
+	fl2000_stream_account(fl2000_dev);
+
+	spin_lock_irq(&fl2000_dev->list_lock);
+	resend = list_empty(&fl2000_dev->transmit_list);
+	list_for_each_entry_safe (cur_sb, temp_sb, &fl2000_dev->wait_list,
+				  list) {
+		cur_sb->in_flight = 0;
+		if (resend && list_is_last(&cur_sb->list, &fl2000_dev->wait_list))
+			list_move_tail(&cur_sb->list,
+				       &fl2000_dev->transmit_list);
+		else
+			list_move_tail(&cur_sb->list,
+				       &fl2000_dev->render_list);
+	}
+	spin_unlock_irq(&fl2000_dev->list_lock);
 }
 
+int fl2000_stream_enable(struct fl2000 *fl2000_dev)
+{
+	int ret;
+
+	mutex_lock(&fl2000_dev->stream_lock);
+
+	/* Initialize the queue with buffers */
+	ret = fl2000_stream_get_buffers(fl2000_dev, fl2000_dev->buf_size);
+	if (ret)
+		goto unlock;
+
+	fl2000_dev->active = true;
+	if (!fl2000_dev->paused)
+		fl2000_stream_start(fl2000_dev);
+
+unlock:
+	mutex_unlock(&fl2000_dev->stream_lock);
+	return ret;
+}
+
+/* Buffers are retained for the next enable, shrinker releases them under memory pressure */
 void fl2000_stream_disable(struct fl2000 *fl2000_dev)
 {
 	struct fl2000_stream_buf *cur_sb;
+	unsigned long idle_pages = 0;
 
-	fl2000_dev->enabled = false;
+	mutex_lock(&fl2000_dev->stream_lock);
 
-	complete_all(&fl2000_dev->stream_complete);
-	cancel_work_sync(&fl2000_dev->stream_work);
-	drain_workqueue(fl2000_dev->stream_work_queue);
+	fl2000_dev->active = false;
+	if (fl2000_dev->enabled)
+		fl2000_stream_stop(fl2000_dev, true);
 
-	if (!usb_wait_anchor_empty_timeout(&fl2000_dev->anchor, 1000))
-		usb_kill_anchored_urbs(&fl2000_dev->anchor);
+	spin_lock_irq(&fl2000_dev->list_lock);
+	list_splice_tail_init(&fl2000_dev->transmit_list,
+			      &fl2000_dev->render_list);
+	list_splice_tail_init(&fl2000_dev->wait_list,
+			      &fl2000_dev->render_list);
+	list_splice_tail_init(&fl2000_dev->pending_list,
+			      &fl2000_dev->render_list);
+	list_for_each_entry (cur_sb, &fl2000_dev->render_list, list)
+		idle_pages += cur_sb->nr_pages;
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	WRITE_ONCE(fl2000_dev->idle_pages, idle_pages);
+
+	mutex_unlock(&fl2000_dev->stream_lock);
+}
+
+/**
+ * fl2000_stream_pause() - temporarily stop streaming keeping buffers
+ * @fl2000_dev:	FL2000 device
+ *
+ * Kills all stream URBs immediately. Stream is not restarted by enable until resumed. Calls may
+ * be nested, each shall be balanced with fl2000_stream_resume()
+ */
+void fl2000_stream_pause(struct fl2000 *fl2000_dev)
+{
+	mutex_lock(&fl2000_dev->stream_lock);
+	if (fl2000_dev->enabled)
+		fl2000_stream_stop(fl2000_dev, false);
+	fl2000_dev->paused++;
+	mutex_unlock(&fl2000_dev->stream_lock);
+}
+
+/**
+ * fl2000_stream_resume() - restart streaming stopped with fl2000_stream_pause()
+ * @fl2000_dev:	FL2000 device
+ *
+ * Stream restarts from the latest frame if it is still enabled by DRM
+ */
+void fl2000_stream_resume(struct fl2000 *fl2000_dev)
+{
+	mutex_lock(&fl2000_dev->stream_lock);
+	if (!WARN_ON(!fl2000_dev->paused) && !--fl2000_dev->paused &&
+	    fl2000_dev->active)
+		fl2000_stream_start(fl2000_dev);
+	mutex_unlock(&fl2000_dev->stream_lock);
+}
+
+/**
+ * fl2000_stream_set_depth() - change number of stream buffers submitted at once
+ * @fl2000_dev:	FL2000 device
+ * @depth:	requested queue depth
+ *
+ * Takes effect immediately if stream is enabled: new submission slots are added right away and
+ * extra ones are dropped as soon as they become available
+ *
+ * Return: Queue depth actually set
+ */
+unsigned int fl2000_stream_set_depth(struct fl2000 *fl2000_dev,
+				     unsigned int depth)
+{
+	unsigned int old_depth;
+
+	depth = clamp_t(unsigned int, depth, FL2000_QUEUE_DEPTH_MIN,
+			FL2000_QUEUE_DEPTH_MAX);
 
 	spin_lock_irq(&fl2000_dev->list_lock);
-	while (!list_empty(&fl2000_dev->transmit_list)) {
-		cur_sb = list_first_entry(&fl2000_dev->transmit_list,
-					  struct fl2000_stream_buf, list);
-		list_move_tail(&cur_sb->list, &fl2000_dev->render_list);
+	old_depth = fl2000_dev->queue_depth;
+	fl2000_dev->queue_depth = depth;
+	if (fl2000_dev->enabled) {
+		if (old_depth < depth) {
+			atomic_add(depth - old_depth,
+				   &fl2000_dev->stream_credits);
+			queue_work(fl2000_stream_wq, &fl2000_dev->stream_work);
+		} else if (old_depth > depth) {
+			atomic_add(old_depth - depth,
+				   &fl2000_dev->depth_debt);
+		}
 	}
-	while (!list_empty(&fl2000_dev->wait_list)) {
-		cur_sb = list_first_entry(&fl2000_dev->wait_list,
-					  struct fl2000_stream_buf, list);
-		list_move_tail(&cur_sb->list, &fl2000_dev->render_list);
+	spin_unlock_irq(&fl2000_dev->list_lock);
+
+	return depth;
+}
+
+/* Bytes sent in one burst by the bulk endpoint */
+static unsigned int fl2000_stream_bulk_burst(struct usb_device *usb_dev,
+					     struct usb_host_endpoint *ep)
+{
+	unsigned int maxp = usb_endpoint_maxp(&ep->desc);
+
+	if (usb_dev->speed >= USB_SPEED_SUPER)
+		return maxp * (ep->ss_ep_comp.bMaxBurst + 1);
+
+	return maxp;
+}
+
+/* Bulk OUT endpoint of the altsetting, if any */
+static struct usb_host_endpoint *
+fl2000_stream_bulk_ep(struct usb_host_interface *alt)
+{
+	unsigned int i;
+
+	for (i = 0; i < alt->desc.bNumEndpoints; i++) {
+		struct usb_host_endpoint *ep = &alt->endpoint[i];
+
+		if (usb_endpoint_is_bulk_out(&ep->desc))
+			return ep;
 	}
-	
-	fl2000_stream_put_buffers(fl2000_dev);
-	spin_unlock(&fl2000_dev->list_lock);
+
+	return NULL;
+}
+
+/* Select bulk altsetting of interface 0: the forced one or the one with the largest burst. Ties are
+ * resolved towards altsetting 1 that has always been used
+ */
+static int fl2000_stream_bulk_setup(struct fl2000 *fl2000_dev)
+{
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	struct usb_interface *intf = fl2000_dev->intf[FL2000_USBIF_AVCONTROL];
+	struct usb_host_interface *best = NULL;
+	struct usb_host_endpoint *best_ep = NULL;
+	unsigned int i, burst, best_burst = 0;
+	int ret;
+
+	for (i = 0; i < intf->num_altsetting; i++) {
+		struct usb_host_interface *alt = &intf->altsetting[i];
+		struct usb_host_endpoint *ep = fl2000_stream_bulk_ep(alt);
+
+		if (!ep)
+			continue;
+
+		burst = fl2000_stream_bulk_burst(usb_dev, ep);
+		dev_dbg(&usb_dev->dev, "Bulk altsetting %u, %u bytes burst",
+			alt->desc.bAlternateSetting, burst);
+
+		if (bulk_alt >= 0) {
+			if (alt->desc.bAlternateSetting != bulk_alt)
+				continue;
+		} else if (burst < best_burst ||
+			   (burst == best_burst &&
+			    alt->desc.bAlternateSetting != 1)) {
+			continue;
+		}
+
+		best = alt;
+		best_ep = ep;
+		best_burst = burst;
+	}
+
+	if (!best) {
+		dev_err(&usb_dev->dev, "No bulk altsetting %d", bulk_alt);
+		return -ENODEV;
+	}
+
+	ret = usb_set_interface(usb_dev, FL2000_USBIF_AVCONTROL,
+				best->desc.bAlternateSetting);
+	if (ret) {
+		dev_err(&usb_dev->dev,
+			"Cannot set streaming interface for bulk transfers");
+		return ret;
+	}
+
+	fl2000_dev->bulk.altsetting = best->desc.bAlternateSetting;
+	fl2000_dev->bulk.burst = best_burst;
+	fl2000_dev->bulk.pipe =
+		usb_sndbulkpipe(usb_dev, usb_endpoint_num(&best_ep->desc));
+
+	return 0;
+}
+
+/**
+ * fl2000_stream_set_transport() - switch between bulk and isochronous transfers
+ * @fl2000_dev:	FL2000 device
+ * @transport:	requested transport
+ *
+ * Return: Operation result, -EBUSY if stream is enabled
+ */
+int fl2000_stream_set_transport(struct fl2000 *fl2000_dev,
+				enum fl2000_transport transport)
+{
+	struct usb_device *usb_dev = fl2000_dev->usb_dev;
+	int ret = 0;
+
+	mutex_lock(&fl2000_dev->stream_lock);
+
+	if (transport == fl2000_dev->transport)
+		goto unlock;
+
+	if (fl2000_dev->active) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	if (transport == FL2000_TRANSPORT_ISOC) {
+		ret = fl2000_isoc_setup(fl2000_dev);
+		if (ret) {
+			fl2000_stream_bulk_setup(fl2000_dev);
+			goto unlock;
+		}
+	} else {
+		fl2000_isoc_release(fl2000_dev);
+		ret = fl2000_stream_bulk_setup(fl2000_dev);
+		if (ret)
+			goto unlock;
+	}
+
+	fl2000_set_isoc(usb_dev, transport == FL2000_TRANSPORT_ISOC);
+	fl2000_dev->transport = transport;
+
+unlock:
+	mutex_unlock(&fl2000_dev->stream_lock);
+	return ret;
 }
 
 /**
@@ -430,27 +1563,35 @@ int fl2000_stream_create(struct fl2000 *fl2000_dev)
 	int ret;
 	struct usb_device *usb_dev = fl2000_dev->usb_dev;
 
-	/* Altsetting 1 on interface 0 */
-	ret = usb_set_interface(usb_dev, FL2000_USBIF_AVCONTROL, 1);
-	if (ret) {
-		dev_err(&usb_dev->dev,
-			"Cannot set streaming interface for bulk transfers");
+	ret = fl2000_stream_bulk_setup(fl2000_dev);
+	if (ret)
 		return ret;
-	}
 
 	INIT_WORK(&fl2000_dev->stream_work, &fl2000_stream_work);
+	INIT_WORK(&fl2000_dev->restart_work, &fl2000_stream_restart_work);
+	INIT_DELAYED_WORK(&fl2000_dev->watchdog, &fl2000_stream_watchdog);
+	INIT_DELAYED_WORK(&fl2000_dev->retry_work, &fl2000_stream_retry_work);
 	INIT_LIST_HEAD(&fl2000_dev->render_list);
 	INIT_LIST_HEAD(&fl2000_dev->transmit_list);
 	INIT_LIST_HEAD(&fl2000_dev->wait_list);
+	INIT_LIST_HEAD(&fl2000_dev->pending_list);
 	spin_lock_init(&fl2000_dev->list_lock);
 	init_usb_anchor(&fl2000_dev->anchor);
-	init_completion(&fl2000_dev->stream_complete);
+	mutex_init(&fl2000_dev->stream_lock);
+	fl2000_pacing_init(fl2000_dev);
+	fl2000_telemetry_init(fl2000_dev);
+	fl2000_dev->queue_depth = FL2000_SB_MIN;
 
-	fl2000_dev->stream_work_queue = create_workqueue("fl2000_stream");
-	if (!fl2000_dev->stream_work_queue) {
-		dev_err(&usb_dev->dev, "Allocate streaming workqueue failed");
+	ret = fl2000_stream_shrinker_init(fl2000_dev);
+	if (ret) {
+		dev_err(&usb_dev->dev, "Cannot register buffers shrinker");
 		fl2000_stream_release(fl2000_dev);
-		return -ENOMEM;
+		return ret;
 	}
+
+	if (isoc && fl2000_stream_set_transport(fl2000_dev,
+						FL2000_TRANSPORT_ISOC))
+		dev_warn(&usb_dev->dev, "Falling back to bulk transfers");
+
 	return 0;
 }
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Low rate sampling of hardware counters while streaming. Pixel clock counter is assumed to be
+ * free running, so measured pixel clock is its increment over host time, accumulated over a long
+ * window to average out control transfer latency. It verifies PLL configuration computed for the
+ * mode. Line buffer watermark of the last frame and maximum accumulation show how close output is
+ * to underflow before it actually happens. Semantics of these registers are not documented, raw
+ * values are kept along with interpretation.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/math64.h>
+
+#include "fl2000.h"
+
+/* Sampling interval, ms. Pixel clock counter wraps in about 530 ms at maximum clock */
+#define FL2000_TELEMETRY_PERIOD_MS 200
+
+/* Pixel clock counter width */
+#define FL2000_TELEMETRY_PXCLK_BITS 28
+
+/* Measurement window is halved once it reaches that, s */
+#define FL2000_TELEMETRY_WINDOW_MAX_S 60
+
+static void fl2000_telemetry_pxclk(struct fl2000_telemetry *tm, u32 count,
+				   ktime_t now)
+{
+	u64 elapsed = ktime_to_ns(ktime_sub(now, tm->stamp));
+	u64 wrap_ns;
+	u32 clocks;
+
+	if (!tm->valid || !tm->pll_clock)
+		return;
+
+	/* Counter may have wrapped more than once, e.g. if work was delayed */
+	wrap_ns = div_u64((1ull << FL2000_TELEMETRY_PXCLK_BITS) * NSEC_PER_SEC,
+			  tm->pll_clock);
+	if (elapsed >= wrap_ns - (wrap_ns >> 2)) {
+		tm->skipped++;
+		return;
+	}
+
+	clocks = (count - tm->pxclk_cnt) &
+		 GENMASK(FL2000_TELEMETRY_PXCLK_BITS - 1, 0);
+	tm->total_clocks += clocks;
+	tm->total_ns += elapsed;
+
+	if (tm->total_ns > FL2000_TELEMETRY_WINDOW_MAX_S * NSEC_PER_SEC) {
+		tm->total_clocks >>= 1;
+		tm->total_ns >>= 1;
+	}
+
+	tm->pixclock = mul_u64_u64_div_u64(tm->total_clocks, NSEC_PER_SEC,
+					   tm->total_ns);
+}
+
+static void fl2000_telemetry_work(struct work_struct *work)
+{
+	struct fl2000_telemetry *tm =
+		container_of(work, struct fl2000_telemetry, work.work);
+	struct fl2000 *fl2000_dev = container_of(tm, struct fl2000, telemetry);
+	struct regmap *regmap = fl2000_dev->regmap;
+	union fl2000_vga_pxclk_cnt_reg_reg pxclk;
+	union fl2000_vga_vcnt_reg vcnt;
+	union fl2000_vga_plt_rdaddr_reg_pxclk plt;
+	unsigned long flags;
+	ktime_t now;
+
+	if (regmap_read(regmap, FL2000_VGA_PXCLK_CNT_REG, &pxclk.val))
+		goto requeue;
+	now = ktime_get();
+
+	if (regmap_read(regmap, FL2000_VGA_VCNT_REG, &vcnt.val) ||
+	    regmap_read(regmap, FL2000_VGA_PLT_RADDR_REG_PXCLK, &plt.val))
+		goto requeue;
+
+	spin_lock_irqsave(&tm->lock, flags);
+
+	fl2000_telemetry_pxclk(tm, pxclk.pix_clock_count, now);
+	tm->pxclk_cnt = pxclk.pix_clock_count;
+	tm->stamp = now;
+	tm->valid = true;
+
+	tm->aclk_count = vcnt.max_aclk_count;
+	tm->aclk_hit = vcnt.max_aclk_count_hit;
+	tm->accumulate = vcnt.max_lbuf_accumulate;
+	tm->watermark = plt.last_frame_lbuf_watermark;
+
+	if (!tm->samples++) {
+		tm->accumulate_max = tm->accumulate;
+		tm->watermark_min = tm->watermark;
+	} else {
+		tm->accumulate_max = max(tm->accumulate_max, tm->accumulate);
+		tm->watermark_min = min(tm->watermark_min, tm->watermark);
+	}
+
+	/* Watermark units are assumed to be the same as of the line buffer thresholds */
+	if (tm->watermark <= READ_ONCE(fl2000_dev->lbuf.lo_mark))
+		tm->near_underflow++;
+
+	tm->history[tm->head] = tm->watermark;
+	tm->head = (tm->head + 1) % FL2000_TELEMETRY_HISTORY;
+
+	spin_unlock_irqrestore(&tm->lock, flags);
+
+requeue:
+	if (READ_ONCE(fl2000_dev->enabled))
+		queue_delayed_work(fl2000_event_wq, &tm->work,
+				   msecs_to_jiffies(FL2000_TELEMETRY_PERIOD_MS));
+}
+
+/**
+ * fl2000_telemetry_mode_set() - set pixel clock programmed into PLL
+ * @fl2000_dev:	FL2000 device
+ * @pll_clock:	pixel clock computed for PLL configuration, Hz
+ *
+ * Measurements of the previous mode are discarded
+ */
+void fl2000_telemetry_mode_set(struct fl2000 *fl2000_dev, u32 pll_clock)
+{
+	struct fl2000_telemetry *tm = &fl2000_dev->telemetry;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm->lock, flags);
+	tm->pll_clock = pll_clock;
+	tm->pixclock = 0;
+	tm->total_clocks = 0;
+	tm->total_ns = 0;
+	tm->valid = false;
+	tm->samples = 0;
+	tm->skipped = 0;
+	tm->near_underflow = 0;
+	tm->head = 0;
+	memset(tm->history, 0, sizeof(tm->history));
+	spin_unlock_irqrestore(&tm->lock, flags);
+}
+
+/* Shall be called on stream start */
+void fl2000_telemetry_start(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_telemetry *tm = &fl2000_dev->telemetry;
+	unsigned long flags;
+
+	/* Counter keeps running while stream is stopped, but the gap may exceed its wrap time */
+	spin_lock_irqsave(&tm->lock, flags);
+	tm->valid = false;
+	spin_unlock_irqrestore(&tm->lock, flags);
+
+	queue_delayed_work(fl2000_event_wq, &tm->work, 0);
+}
+
+/* Shall be called on stream stop, after stream is disabled */
+void fl2000_telemetry_stop(struct fl2000 *fl2000_dev)
+{
+	cancel_delayed_work_sync(&fl2000_dev->telemetry.work);
+}
+
+void fl2000_telemetry_init(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_telemetry *tm = &fl2000_dev->telemetry;
+
+	spin_lock_init(&tm->lock);
+	INIT_DELAYED_WORK(&tm->work, &fl2000_telemetry_work);
+}
@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Tiled groups compose one large surface from several devices. Every member advertises its place
+ * in the group with the TILE connector property and scans out its own part of the shared
+ * framebuffer selected by the plane source rectangle, so only that part is converted. Converted
+ * frames are held back until all streaming members have their frame ready, and then are released
+ * for transmission together. Devices are not genlocked, so tiles flip within one frame period.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+#include <drm/drm_probe_helper.h>
+
+#include "fl2000.h"
+
+/* Do not wait for a member that has nothing to show longer than this, ms */
+#define FL2000_TILE_WAIT_MS 50
+
+struct fl2000_tile_group {
+	struct list_head list;
+	u32 id;
+	struct list_head members;
+};
+
+static LIST_HEAD(fl2000_tile_groups);
+static DEFINE_MUTEX(fl2000_tile_lock);
+
+/* Shall be called with tile lock held */
+static void fl2000_tile_flip_group(struct fl2000_tile_group *group)
+{
+	struct fl2000 *member;
+
+	list_for_each_entry (member, &group->members, tile.node) {
+		if (fl2000_stream_tile_flip(member))
+			member->tile.flips++;
+	}
+}
+
+/**
+ * fl2000_tile_commit() - release converted frame when all tiles are ready
+ * @fl2000_dev:	FL2000 device
+ *
+ * Shall be called after frame conversion
+ */
+void fl2000_tile_commit(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_tile_group *group;
+	struct fl2000 *member;
+
+	mutex_lock(&fl2000_tile_lock);
+
+	group = fl2000_dev->tile.group;
+	if (!group) {
+		fl2000_stream_tile_flip(fl2000_dev);
+		goto unlock;
+	}
+
+	list_for_each_entry (member, &group->members, tile.node) {
+		if (READ_ONCE(member->enabled) &&
+		    !fl2000_stream_tile_pending(member)) {
+			/* Other tiles might not change at all */
+			queue_delayed_work(fl2000_event_wq,
+					   &fl2000_dev->tile.flush_work,
+					   msecs_to_jiffies(FL2000_TILE_WAIT_MS));
+			goto unlock;
+		}
+	}
+
+	fl2000_tile_flip_group(group);
+
+unlock:
+	mutex_unlock(&fl2000_tile_lock);
+}
+
+static void fl2000_tile_flush_work(struct work_struct *work)
+{
+	struct fl2000 *fl2000_dev =
+		container_of(work, struct fl2000, tile.flush_work.work);
+
+	mutex_lock(&fl2000_tile_lock);
+	if (fl2000_dev->tile.group)
+		fl2000_tile_flip_group(fl2000_dev->tile.group);
+	else
+		fl2000_stream_tile_flip(fl2000_dev);
+	mutex_unlock(&fl2000_tile_lock);
+}
+
+/* Shall be called with tile lock held */
+static void fl2000_tile_unlink(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_tile *tile = &fl2000_dev->tile;
+	struct fl2000_tile_group *group = tile->group;
+
+	if (!group)
+		return;
+
+	list_del(&tile->node);
+	tile->group = NULL;
+
+	/* Do not keep frames that no longer need to wait for anyone */
+	fl2000_stream_tile_flip(fl2000_dev);
+
+	if (list_empty(&group->members)) {
+		list_del(&group->list);
+		kfree(group);
+	}
+}
+
+/**
+ * fl2000_tile_set() - place device in a tiled group
+ * @fl2000_dev:	FL2000 device
+ * @cfg:	tile configuration, zero group id removes device from its group
+ *
+ * Return: Operation result
+ */
+int fl2000_tile_set(struct fl2000 *fl2000_dev,
+		    const struct fl2000_tile_cfg *cfg)
+{
+	struct drm_device *drm = &fl2000_dev->drm;
+	struct fl2000_tile *tile = &fl2000_dev->tile;
+	struct fl2000_tile_group *group, *new_group = NULL;
+
+	if (cfg->id && (!cfg->cols || !cfg->rows || cfg->col >= cfg->cols ||
+			cfg->row >= cfg->rows || !cfg->width || !cfg->height))
+		return -EINVAL;
+
+	if (cfg->id) {
+		new_group = kzalloc(sizeof(*new_group), GFP_KERNEL);
+		if (!new_group)
+			return -ENOMEM;
+		new_group->id = cfg->id;
+		INIT_LIST_HEAD(&new_group->members);
+	}
+
+	mutex_lock(&fl2000_tile_lock);
+
+	fl2000_tile_unlink(fl2000_dev);
+
+	tile->cfg = *cfg;
+
+	if (!cfg->id)
+		goto unlock;
+
+	list_for_each_entry (group, &fl2000_tile_groups, list) {
+		if (group->id == cfg->id)
+			goto join;
+	}
+
+	group = new_group;
+	new_group = NULL;
+	list_add_tail(&group->list, &fl2000_tile_groups);
+
+join:
+	list_add_tail(&tile->node, &group->members);
+	tile->group = group;
+
+unlock:
+	mutex_unlock(&fl2000_tile_lock);
+
+	kfree(new_group);
+
+	/* Let userspace know about new topology */
+	mutex_lock(&drm->mode_config.mutex);
+	fl2000_connector_update_tile(fl2000_dev);
+	mutex_unlock(&drm->mode_config.mutex);
+	drm_kms_helper_hotplug_event(drm);
+
+	return 0;
+}
+
+void fl2000_tile_get(struct fl2000 *fl2000_dev, struct fl2000_tile_cfg *cfg)
+{
+	mutex_lock(&fl2000_tile_lock);
+	*cfg = fl2000_dev->tile.cfg;
+	mutex_unlock(&fl2000_tile_lock);
+}
+
+void fl2000_tile_init(struct fl2000 *fl2000_dev)
+{
+	INIT_DELAYED_WORK(&fl2000_dev->tile.flush_work,
+			  &fl2000_tile_flush_work);
+}
+
+/* Shall be called before stream is released */
+void fl2000_tile_release(struct fl2000 *fl2000_dev)
+{
+	mutex_lock(&fl2000_tile_lock);
+	fl2000_tile_unlink(fl2000_dev);
+	mutex_unlock(&fl2000_tile_lock);
+
+	/* Not queued again once device is out of the group */
+	cancel_delayed_work_sync(&fl2000_dev->tile.flush_work);
+}
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fl2000
+
+#if !defined(__FL2000_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __FL2000_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+#include "fl2000.h"
+
+TRACE_EVENT(fl2000_intr,
+	TP_PROTO(struct usb_device *usb_dev, u32 status),
+	TP_ARGS(usb_dev, status),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u32, status)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->status = status;
+	),
+	TP_printk("usb=%d-%d status=0x%08x", __entry->busnum, __entry->devnum,
+		  __entry->status)
+);
+
+TRACE_DEFINE_ENUM(FL2000_SB_RENDER);
+TRACE_DEFINE_ENUM(FL2000_SB_PENDING);
+TRACE_DEFINE_ENUM(FL2000_SB_TRANSMIT);
+TRACE_DEFINE_ENUM(FL2000_SB_WAIT);
+
+/* Frame lifecycle. Every frame gets a sequence number on commit, which is carried by its stream
+ * buffer through conversion, submission and completion
+ */
+TRACE_EVENT(fl2000_dirty,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u32 x, u32 y, u32 width,
+		 u32 height),
+	TP_ARGS(usb_dev, seq, x, y, width, height),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(u32, x)
+		__field(u32, y)
+		__field(u32, width)
+		__field(u32, height)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->width = width;
+		__entry->height = height;
+	),
+	TP_printk("usb=%d-%d seq=%llu src=%ux%u+%u+%u", __entry->busnum,
+		  __entry->devnum, __entry->seq, __entry->width,
+		  __entry->height, __entry->x, __entry->y)
+);
+
+DECLARE_EVENT_CLASS(fl2000_convert,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u32 rows, u32 bytes),
+	TP_ARGS(usb_dev, seq, rows, bytes),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(u32, rows)
+		__field(u32, bytes)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->rows = rows;
+		__entry->bytes = bytes;
+	),
+	TP_printk("usb=%d-%d seq=%llu rows=%u bytes=%u", __entry->busnum,
+		  __entry->devnum, __entry->seq, __entry->rows, __entry->bytes)
+);
+
+DEFINE_EVENT(fl2000_convert, fl2000_convert_start,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u32 rows, u32 bytes),
+	TP_ARGS(usb_dev, seq, rows, bytes)
+);
+
+DEFINE_EVENT(fl2000_convert, fl2000_convert_end,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u32 rows, u32 bytes),
+	TP_ARGS(usb_dev, seq, rows, bytes)
+);
+
+TRACE_EVENT(fl2000_buf_state,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, const void *sb,
+		 enum fl2000_sb_state state),
+	TP_ARGS(usb_dev, seq, sb, state),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(const void *, sb)
+		__field(u32, state)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->sb = sb;
+		__entry->state = state;
+	),
+	TP_printk("usb=%d-%d seq=%llu sb=%p state=%s", __entry->busnum,
+		  __entry->devnum, __entry->seq, __entry->sb,
+		  __print_symbolic(__entry->state,
+				   { FL2000_SB_RENDER, "render" },
+				   { FL2000_SB_PENDING, "pending" },
+				   { FL2000_SB_TRANSMIT, "transmit" },
+				   { FL2000_SB_WAIT, "wait" }))
+);
+
+TRACE_EVENT(fl2000_urb_submit,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u32 length),
+	TP_ARGS(usb_dev, seq, length),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->length = length;
+	),
+	TP_printk("usb=%d-%d seq=%llu length=%u", __entry->busnum,
+		  __entry->devnum, __entry->seq, __entry->length)
+);
+
+TRACE_EVENT(fl2000_urb_complete,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, int status,
+		 u32 actual_length),
+	TP_ARGS(usb_dev, seq, status, actual_length),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(int, status)
+		__field(u32, actual_length)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->status = status;
+		__entry->actual_length = actual_length;
+	),
+	TP_printk("usb=%d-%d seq=%llu status=%d actual_length=%u",
+		  __entry->busnum, __entry->devnum, __entry->seq,
+		  __entry->status, __entry->actual_length)
+);
+
+/* Sequence number is of the latest frame completely sent to the device */
+TRACE_EVENT(fl2000_vblank,
+	TP_PROTO(struct usb_device *usb_dev, u64 seq, u64 count),
+	TP_ARGS(usb_dev, seq, count),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u64, seq)
+		__field(u64, count)
+	),
+	TP_fast_assign(
+		__entry->busnum = usb_dev->bus->busnum;
+		__entry->devnum = usb_dev->devnum;
+		__entry->seq = seq;
+		__entry->count = count;
+	),
+	TP_printk("usb=%d-%d seq=%llu count=%llu", __entry->busnum,
+		  __entry->devnum, __entry->seq, __entry->count)
+);
+
+#endif /* __FL2000_TRACE_H__ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fl2000_trace
+#include <trace/define_trace.h>
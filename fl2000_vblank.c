@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Vblank is generated by a timer running at the frame rate of the programmed mode, so it does not
+ * depend on USB completions and keeps going if stream stalls. Timer is kept in step with the
+ * output using frame counter of the VGA status register: its period is compensated for the
+ * measured clock drift and accumulated frame count difference is slewed out gradually.
+ *
+ * (C) Copyright 2025, Artem Mygaiev
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+
+#include <drm/drm_vblank.h>
+
+#include "fl2000.h"
+#include "fl2000_trace.h"
+
+/* Interval of frame counter sampling while vblank is enabled, ms */
+#define FL2000_VBLANK_RESYNC_MS 1000
+
+/* Frame counter samples closer than that are too noisy to measure the period, ms */
+#define FL2000_VBLANK_WINDOW_MIN_MS 900
+
+/* Frame counter is 16 bits wide, longer windows are ambiguous, ms */
+#define FL2000_VBLANK_WINDOW_MAX_MS 60000
+
+/* Maximum trim of the nominal period, ppm. Measurements outside are considered bogus */
+#define FL2000_VBLANK_TRIM_PPM 5000
+
+/* Phase correction applied per frame, fraction of the period */
+#define FL2000_VBLANK_SLEW_DIV 16
+
+static enum hrtimer_restart fl2000_vblank_timer(struct hrtimer *timer)
+{
+	struct fl2000_vblank *vblank =
+		container_of(timer, struct fl2000_vblank, timer);
+	struct fl2000 *fl2000_dev = container_of(vblank, struct fl2000, vblank);
+	unsigned long flags;
+	s64 slew;
+
+	spin_lock_irqsave(&vblank->lock, flags);
+
+	/* Disable does not wait for the callback, and enable may have started the timer anew */
+	if (!vblank->enabled || hrtimer_is_queued(timer)) {
+		spin_unlock_irqrestore(&vblank->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	vblank->stamp = hrtimer_get_expires(timer);
+	vblank->frames++;
+
+	hrtimer_forward_now(timer, vblank->period);
+
+	/* Shift next expiry a bit towards hardware frame */
+	slew = clamp_t(s64, vblank->slew_ns,
+		       -div_s64(ktime_to_ns(vblank->period),
+				FL2000_VBLANK_SLEW_DIV),
+		       div_s64(ktime_to_ns(vblank->period),
+			       FL2000_VBLANK_SLEW_DIV));
+	if (slew) {
+		hrtimer_add_expires_ns(timer, slew);
+		vblank->slew_ns -= slew;
+	}
+
+	spin_unlock_irqrestore(&vblank->lock, flags);
+
+	trace_fl2000_vblank(fl2000_dev->usb_dev,
+			    READ_ONCE(fl2000_dev->shown_seq), vblank->frames);
+
+	drm_crtc_handle_vblank(&fl2000_dev->pipe.crtc);
+
+	return HRTIMER_RESTART;
+}
+
+static void fl2000_vblank_resync_work(struct work_struct *work)
+{
+	struct fl2000_vblank *vblank =
+		container_of(work, struct fl2000_vblank, resync_work.work);
+	struct fl2000 *fl2000_dev = container_of(vblank, struct fl2000, vblank);
+
+	/* Frame counter is sampled as a side effect of status processing */
+	fl2000_intr_poll(fl2000_dev);
+	fl2000_drift_poll(fl2000_dev);
+
+	if (READ_ONCE(vblank->enabled))
+		queue_delayed_work(fl2000_event_wq, &vblank->resync_work,
+				   msecs_to_jiffies(FL2000_VBLANK_RESYNC_MS));
+}
+
+/**
+ * fl2000_vblank_sample() - account hardware frame counter
+ * @fl2000_dev:	FL2000 device
+ * @frame_cnt:	frame counter of the VGA status register
+ *
+ * Can be called from atomic context
+ */
+void fl2000_vblank_sample(struct fl2000 *fl2000_dev, u16 frame_cnt)
+{
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	s64 elapsed, nominal, measured;
+	u16 frames;
+	s64 offset;
+
+	spin_lock_irqsave(&vblank->lock, flags);
+
+	if (!vblank->enabled || !vblank->nominal)
+		goto unlock;
+
+	elapsed = ktime_ms_delta(now, vblank->hw_stamp);
+	frames = frame_cnt - vblank->hw_cnt;
+
+	if (vblank->hw_valid && elapsed < FL2000_VBLANK_WINDOW_MIN_MS)
+		goto unlock;
+
+	if (!vblank->hw_valid || elapsed > FL2000_VBLANK_WINDOW_MAX_MS ||
+	    !frames) {
+		fl2000_drift_reset(fl2000_dev);
+		goto reference;
+	}
+
+	nominal = ktime_to_ns(vblank->nominal);
+	measured = div_s64(ktime_to_ns(ktime_sub(now, vblank->hw_stamp)),
+			   frames);
+	if (abs(measured - nominal) >
+	    div_s64(nominal * FL2000_VBLANK_TRIM_PPM, 1000000)) {
+		vblank->hw_bogus++;
+		fl2000_drift_reset(fl2000_dev);
+		goto reference;
+	}
+
+	vblank->period = fl2000_drift_update(fl2000_dev,
+					     ktime_sub(now, vblank->hw_stamp),
+					     frames, vblank->nominal);
+	vblank->hw_frames += frames;
+	vblank->resyncs++;
+
+	/* Timer frames that are ahead of or behind the output are slewed out. Sampling is not
+	 * aligned to frame boundary, so one frame difference is just noise
+	 */
+	offset = (s64)(vblank->frames - vblank->hw_ref) - frames;
+	vblank->offset = offset;
+	if (abs(offset) > 1)
+		vblank->slew_ns = offset * measured;
+
+reference:
+	vblank->hw_cnt = frame_cnt;
+	vblank->hw_stamp = now;
+	vblank->hw_ref = vblank->frames;
+	vblank->hw_valid = true;
+
+unlock:
+	spin_unlock_irqrestore(&vblank->lock, flags);
+}
+
+/**
+ * fl2000_vblank_mode_set() - set frame period of the output
+ * @fl2000_dev:	FL2000 device
+ * @mode:	display mode
+ * @pixclock:	exact pixel clock produced by PLL, Hz
+ *
+ * Shall be called from mode_set, before vblank is enabled
+ */
+void fl2000_vblank_mode_set(struct fl2000 *fl2000_dev,
+			    const struct drm_display_mode *mode, u32 pixclock)
+{
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	unsigned long flags;
+	ktime_t period = 0;
+
+	if (pixclock)
+		period = ns_to_ktime(div_u64((u64)mode->htotal * mode->vtotal *
+						     NSEC_PER_SEC,
+					     pixclock));
+
+	spin_lock_irqsave(&vblank->lock, flags);
+	vblank->nominal = period;
+	vblank->period = period;
+	vblank->slew_ns = 0;
+	vblank->offset = 0;
+	vblank->hw_valid = false;
+	fl2000_drift_reset(fl2000_dev);
+	spin_unlock_irqrestore(&vblank->lock, flags);
+}
+
+int fl2000_vblank_enable(struct drm_simple_display_pipe *pipe)
+{
+	struct fl2000 *fl2000_dev = pipe->crtc.dev->dev_private;
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vblank->lock, flags);
+	if (!vblank->period) {
+		spin_unlock_irqrestore(&vblank->lock, flags);
+		return -EINVAL;
+	}
+	vblank->enabled = true;
+	vblank->hw_valid = false;
+	vblank->stamp = ktime_get();
+	hrtimer_start(&vblank->timer, ktime_add(vblank->stamp, vblank->period),
+		      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&vblank->lock, flags);
+
+	queue_delayed_work(fl2000_event_wq, &vblank->resync_work, 0);
+
+	return 0;
+}
+
+void fl2000_vblank_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct fl2000 *fl2000_dev = pipe->crtc.dev->dev_private;
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	unsigned long flags;
+
+	/* Called by DRM with interrupts off and vblank locks held, which timer callback also takes,
+	 * so it cannot wait for the callback. Running callback sees the flag and stops the timer
+	 */
+	spin_lock_irqsave(&vblank->lock, flags);
+	vblank->enabled = false;
+	spin_unlock_irqrestore(&vblank->lock, flags);
+
+	hrtimer_try_to_cancel(&vblank->timer);
+	cancel_delayed_work(&vblank->resync_work);
+}
+
+/* Timestamp of the last timer vblank, which is the one being handled when called from it */
+static bool fl2000_vblank_timestamp(struct drm_crtc *crtc, int *max_error,
+				    ktime_t *vblank_time, bool in_vblank_irq)
+{
+	struct fl2000 *fl2000_dev = crtc->dev->dev_private;
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vblank->lock, flags);
+	*vblank_time = vblank->stamp;
+	spin_unlock_irqrestore(&vblank->lock, flags);
+
+	return true;
+}
+
+/* Shall be called after display pipe initialization */
+void fl2000_vblank_init(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+	struct drm_crtc *crtc = &fl2000_dev->pipe.crtc;
+
+	spin_lock_init(&vblank->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&vblank->timer, fl2000_vblank_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&vblank->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vblank->timer.function = fl2000_vblank_timer;
+#endif
+	INIT_DELAYED_WORK(&vblank->resync_work, &fl2000_vblank_resync_work);
+
+	/* Simple display pipe has no way to provide timestamps, extend its CRTC functions */
+	fl2000_dev->crtc_funcs = *crtc->funcs;
+	fl2000_dev->crtc_funcs.get_vblank_timestamp = fl2000_vblank_timestamp;
+	crtc->funcs = &fl2000_dev->crtc_funcs;
+}
+
+/* Unlike disable, called from process context and waits for the timer callback */
+void fl2000_vblank_release(struct fl2000 *fl2000_dev)
+{
+	struct fl2000_vblank *vblank = &fl2000_dev->vblank;
+
+	WRITE_ONCE(vblank->enabled, false);
+	hrtimer_cancel(&vblank->timer);
+	cancel_delayed_work_sync(&vblank->resync_work);
+}
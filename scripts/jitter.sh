@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Report per-device frame completion jitter for all attached FL2000 dongles over
+# the given number of seconds. Counters are taken at start and at the end, and
+# statistics of the difference are printed.
+#
+# FL2000 devices cannot be emulated: there is no FL2000 model in qemu or in the
+# kernel, and scripts/emulate.sh only runs the driver in a VM with the real USB
+# host controller passed through with VFIO. Completion timing comes from real
+# dongles pulling frames at their pixel clock, so run this with as many dongles
+# attached as needed, natively or in that VM.
+DURATION=${1:-10}
+DEBUGFS=/sys/kernel/debug/dri
+
+# Prints: intervals, sum of intervals, sum of interval deviations, all in us
+counters() {
+	local n sums
+	n=$(grep "^intervals:" "$1/stream" | awk '{ print $2 }')
+	sums=$(grep "^sums_us:" "$1/stream" | awk '{ print $3, $5 }')
+	echo "$n $sums"
+}
+
+declare -A start
+
+for dri in $DEBUGFS/*
+do
+	if ! grep -q "^fl2000" "$dri/name" 2>/dev/null; then
+		continue
+	fi
+	if [ ! -f "$dri/stream" ]; then
+		continue
+	fi
+	start[$dri]=$(counters $dri)
+done
+
+sleep $DURATION
+
+for dri in "${!start[@]}"
+do
+	read n0 sum0 dev0 <<< "${start[$dri]}"
+	read n1 sum1 dev1 <<< "$(counters $dri)"
+	n=$(( n1 - n0 ))
+	echo -n "$(basename $dri): $n intervals in $DURATION s"
+	if [ $n -gt 0 ]; then
+		echo -n ", interval $(( (sum1 - sum0) / n )) us"
+		echo -n ", jitter $(( (dev1 - dev0) / n )) us"
+	fi
+	echo
+done
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Compare line buffer underflow rates of attached FL2000 dongles. Run it while
+# competing USB traffic is generated on the same bus, once with each transport
+# selected via the 'transport' attribute of the control interface, e.g.:
+#   echo isoc > /sys/bus/usb/devices/<port>:1.0/transport
+DURATION=${1:-60}
+DEBUGFS=/sys/kernel/debug/dri
+
+underflows() {
+	grep "^lbuf_underflow:" "$1/interrupts" | awk '{ print $2 }'
+}
+
+declare -A start
+
+for dri in $DEBUGFS/*
+do
+	if ! grep -q "^fl2000" "$dri/name" 2>/dev/null; then
+		continue
+	fi
+	start[$dri]=$(underflows $dri)
+done
+
+sleep $DURATION
+
+for dri in "${!start[@]}"
+do
+	count=$(( $(underflows $dri) - ${start[$dri]} ))
+	transport=$(grep "^transport:" "$dri/stream" | awk '{ print $2 }')
+	echo "$(basename $dri): $transport, $count underflows in $DURATION s"
+done